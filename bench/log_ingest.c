@@ -0,0 +1,148 @@
+/*
+ * Feed a recorded syslog corpus through log_add() and report lines/s.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log/syslog.h"
+
+#define BENCH_LINE_LEN	1024
+
+struct line {
+	char *buf;
+	int size;
+	int source;
+};
+
+/* logd.c is not linked in, there is nobody to notify */
+void ubus_notify_log(struct log_head *l)
+{
+}
+
+static int usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options] <corpus>\n"
+		"Options:\n"
+		"    -n <count>		Passes over the corpus (default 1000)\n"
+		"    -S <bytes>		Ring size (default 64k)\n"
+		"\n"
+		"The corpus has one message per line, as read from /dev/log or\n"
+		"/proc/kmsg. Lines with a \"[ sec.usec]\" timestamp are fed as\n"
+		"kernel messages.\n", prog);
+	return 1;
+}
+
+static int load_corpus(const char *path, struct line **lines)
+{
+	char buf[BENCH_LINE_LEN], *p;
+	struct line *l = NULL;
+	int n = 0, len;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, "failed to open %s\n", path);
+		return -1;
+	}
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		len = strlen(buf);
+		if (len <= 1)
+			continue;
+		if (!(n % 256)) {
+			l = realloc(l, (n + 256) * sizeof(*l));
+			if (!l) {
+				fclose(fp);
+				return -1;
+			}
+		}
+		p = strchr(buf, '>');
+		l[n].source = (p && (p[1] == '[')) ? SOURCE_KLOG : SOURCE_SYSLOG;
+		l[n].buf = strdup(buf);
+		l[n].size = len + 1;
+		n++;
+	}
+	fclose(fp);
+
+	*lines = l;
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	char buf[BENCH_LINE_LEN + 1];
+	struct timespec start, end;
+	struct line *lines;
+	int passes = 1000, size = 64 * 1024;
+	int ch, i, j, n;
+	double sec;
+	uint64_t total = 0;
+
+	while ((ch = getopt(argc, argv, "n:S:")) != -1) {
+		switch (ch) {
+		case 'n':
+			passes = atoi(optarg);
+			break;
+		case 'S':
+			size = atoi(optarg);
+			break;
+		default:
+			return usage(*argv);
+		}
+	}
+
+	if ((optind != argc - 1) || (passes < 1) || (size < 1024))
+		return usage(*argv);
+
+	n = load_corpus(argv[optind], &lines);
+	if (n <= 0) {
+		fprintf(stderr, "no messages in %s\n", argv[optind]);
+		return 1;
+	}
+
+	if (log_buffer_init(size))
+		return 1;
+
+	/* measure the ingest path itself, not the limiter */
+	log_limits.rate = 0;
+	log_limits.dedup = false;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < passes; i++) {
+		for (j = 0; j < n; j++) {
+			/* log_add() strips the prefix and newline in place */
+			memcpy(buf, lines[j].buf, lines[j].size);
+			log_add(buf, lines[j].size, lines[j].source);
+			total += lines[j].size - 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d lines x %d passes in %.3fs\n", n, passes, sec);
+	printf("%.0f lines/s, %.1f MB/s, %.0f ns/line\n",
+		(double) n * passes / sec, total / sec / 1e6, sec * 1e9 / ((double) n * passes));
+	printf("ingested %u syslog, %u kernel, evicted %u\n",
+		log_stats.ingest[SOURCE_SYSLOG].messages,
+		log_stats.ingest[SOURCE_KLOG].messages,
+		log_stats.evicted.messages);
+
+	for (j = 0; j < n; j++)
+		free(lines[j].buf);
+	free(lines);
+
+	return 0;
+}
@@ -0,0 +1,660 @@
+/*
+ * End to end benchmark of syslog() -> /dev/log -> logd -> logread -f.
+ * Producer threads log sequence numbered and timestamped messages, the
+ * output of each logread is read back to measure delivery and latency.
+ *
+ * logd binds /dev/log and registers the ubus log object, so this needs
+ * root, a running ubusd and no other logd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
+#endif
+
+#define BENCH_TAG	"logbench"
+#define BENCH_MSG_MAX	4096
+#define BENCH_PROBE	-1
+
+enum {
+	SINK_PIPE,
+	SINK_FILE,
+	SINK_TCP,
+	SINK_UDP,
+};
+
+static const char *sink_modes[] = {
+	[SINK_PIPE] = "pipe",
+	[SINK_FILE] = "file",
+	[SINK_TCP] = "tcp",
+	[SINK_UDP] = "udp",
+};
+
+struct producer {
+	pthread_t thread;
+	int id;
+	unsigned int sent;
+};
+
+struct sink {
+	pthread_t thread;
+	bool started;
+	pid_t pid;
+	int fd, listen_fd;
+	char path[32];			/* of the file sink */
+
+	pthread_mutex_t lock;
+	bool ready;
+	uint64_t received;
+	uint64_t dups;
+	uint64_t first_ns, last_ns;
+	unsigned int *next_seq;		/* per producer */
+
+	uint64_t *lat;			/* ns, one per received message */
+	size_t lat_n, lat_size;
+};
+
+static int producers = 4, consumers = 1, rate = 1000, msg_size = 128;
+static int duration = 10, log_size = 64, sink_mode = SINK_PIPE;
+static const char *logd_path = "./logd";
+static const char *logread_path = "./logread";
+
+static int stop, sinks_done;
+
+#define flag_get(x)	__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define flag_set(x)	__atomic_store_n(&(x), 1, __ATOMIC_RELAXED)
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"Options:\n"
+		"    -t <count>		Producer threads (default 4)\n"
+		"    -r <msgs>		Messages per second per producer, 0 for no limit (default 1000)\n"
+		"    -m <bytes>		Message size (default 128)\n"
+		"    -d <secs>		Duration (default 10)\n"
+		"    -c <count>		logread -f consumers (default 1)\n"
+		"    -o <sink>		Where logread writes to: pipe, file, tcp or udp (default pipe)\n"
+		"    -S <kbytes>		logd ring size (default 64)\n"
+		"    -L <path>		logd binary (default ./logd)\n"
+		"    -R <path>		logread binary (default ./logread)\n"
+		"\n"
+		"Needs root, a running ubusd, and no other logd on /dev/log.\n", prog);
+	return 1;
+}
+
+static void log_message(int id, unsigned int seq)
+{
+	char buf[BENCH_MSG_MAX + 1];
+	struct timespec ts;
+	int n;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	n = snprintf(buf, sizeof(buf), "BENCH %d %u %lld.%09ld ",
+		id, seq, (long long) ts.tv_sec, ts.tv_nsec);
+	if (n < msg_size) {
+		memset(buf + n, 'x', msg_size - n);
+		n = msg_size;
+	}
+	buf[n] = '\0';
+	syslog(LOG_INFO, "%s", buf);
+}
+
+static void *producer_run(void *arg)
+{
+	struct producer *p = arg;
+	struct timespec next;
+	long step = rate ? 1000000000L / rate : 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!flag_get(stop)) {
+		log_message(p->id, p->sent++);
+		if (!step)
+			continue;
+
+		next.tv_nsec += step;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	return NULL;
+}
+
+static void sink_add(struct sink *s, const char *line, uint64_t t)
+{
+	long long sec;
+	unsigned int seq;
+	long nsec;
+	int id;
+
+	line = strstr(line, "BENCH ");
+	if (!line || (sscanf(line, "BENCH %d %u %lld.%ld", &id, &seq, &sec, &nsec) != 4))
+		return;
+
+	pthread_mutex_lock(&s->lock);
+	if (id == BENCH_PROBE) {
+		s->ready = true;
+	} else if ((id >= 0) && (id < producers)) {
+		if (seq < s->next_seq[id]) {
+			s->dups++;
+		} else {
+			s->next_seq[id] = seq + 1;
+			if (!s->received)
+				s->first_ns = t;
+			s->last_ns = t;
+			s->received++;
+
+			if (s->lat_n == s->lat_size) {
+				s->lat_size = s->lat_size ? s->lat_size * 2 : 4096;
+				s->lat = realloc(s->lat, s->lat_size * sizeof(*s->lat));
+				if (!s->lat) {
+					fprintf(stderr, "out of memory\n");
+					exit(1);
+				}
+			}
+			s->lat[s->lat_n++] = t - ((uint64_t) sec * 1000000000ULL + nsec);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void *sink_run(void *arg)
+{
+	struct sink *s = arg;
+	char buf[2 * BENCH_MSG_MAX], *p, *e;
+	struct pollfd pfd = { .events = POLLIN };
+	size_t len = 0;
+	ssize_t n;
+	uint64_t t;
+
+	if (sink_mode == SINK_TCP) {
+		pfd.fd = s->listen_fd;
+		while (!flag_get(sinks_done) && (poll(&pfd, 1, 100) <= 0))
+			;
+		s->fd = flag_get(sinks_done) ? -1 : accept(s->listen_fd, NULL, NULL);
+		if (s->fd < 0)
+			return NULL;
+	}
+
+	pfd.fd = s->fd;
+	while (!flag_get(sinks_done)) {
+		if ((sink_mode != SINK_FILE) && (poll(&pfd, 1, 100) <= 0))
+			continue;
+
+		n = read(s->fd, buf + len, sizeof(buf) - len - 1);
+		if ((n < 0) && (errno == EINTR))
+			continue;
+		if (n < 0)
+			break;
+		if (!n) {
+			/* logread went away, or the file has no new lines yet */
+			if (sink_mode != SINK_FILE)
+				break;
+			usleep(1000);
+			continue;
+		}
+
+		t = now_ns();
+		if (sink_mode == SINK_UDP) {
+			buf[n] = '\0';
+			sink_add(s, buf, t);
+			continue;
+		}
+
+		len += n;
+		buf[len] = '\0';
+		for (p = buf; (e = strchr(p, '\n')); p = e + 1) {
+			*e = '\0';
+			sink_add(s, p, t);
+		}
+		len -= p - buf;
+		memmove(buf, p, len);
+		if (len == sizeof(buf) - 1)
+			len = 0;
+	}
+
+	return NULL;
+}
+
+static pid_t spawn(const char *path, char *const argv[], int out)
+{
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+
+	if (!pid) {
+		if (out >= 0) {
+			dup2(out, STDOUT_FILENO);
+			close(out);
+		}
+		execv(path, argv);
+		fprintf(stderr, "failed to start %s: %s\n", path, strerror(errno));
+		_exit(127);
+	}
+
+	return pid;
+}
+
+static int sink_start(struct sink *s)
+{
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t sin_len = sizeof(sin);
+	int fd, pipefd[2], size = 4 * 1024 * 1024, n = 0, out = -1;
+	char port[8], *argv[8];
+
+	argv[n++] = (char *) logread_path;
+	argv[n++] = "-f";
+
+	switch (sink_mode) {
+	case SINK_PIPE:
+		if (pipe(pipefd))
+			return -1;
+		s->fd = pipefd[0];
+		out = pipefd[1];
+		break;
+
+	case SINK_FILE:
+		strcpy(s->path, "/tmp/log_pipeline.XXXXXX");
+		s->fd = mkstemp(s->path);
+		if (s->fd < 0)
+			return -1;
+		argv[n++] = "-F";
+		argv[n++] = s->path;
+		break;
+
+	case SINK_TCP:
+	case SINK_UDP:
+		fd = socket(AF_INET, (sink_mode == SINK_TCP) ? SOCK_STREAM : SOCK_DGRAM, 0);
+		if (fd < 0)
+			return -1;
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) ||
+		    getsockname(fd, (struct sockaddr *) &sin, &sin_len) ||
+		    ((sink_mode == SINK_TCP) && listen(fd, 1))) {
+			close(fd);
+			return -1;
+		}
+		if (sink_mode == SINK_TCP) {
+			s->listen_fd = fd;
+		} else {
+			s->fd = fd;
+			argv[n++] = "-u";
+		}
+		snprintf(port, sizeof(port), "%d", ntohs(sin.sin_port));
+		argv[n++] = "-r";
+		argv[n++] = "127.0.0.1";
+		argv[n++] = port;
+		break;
+	}
+	argv[n] = NULL;
+
+	s->pid = spawn(logread_path, argv, out);
+	if (out >= 0)
+		close(out);
+	if (s->pid < 0)
+		return -1;
+
+	if (pthread_create(&s->thread, NULL, sink_run, s))
+		return -1;
+	s->started = true;
+
+	return 0;
+}
+
+static bool running(pid_t pid)
+{
+	return waitpid(pid, NULL, WNOHANG) == 0;
+}
+
+/* logd unlinks and binds /dev/log, wait until its socket takes messages */
+static bool logd_wait(pid_t pid)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX, .sun_path = "/dev/log" };
+	int i, fd, ret;
+
+	for (i = 0; i < 100; i++) {
+		usleep(50 * 1000);
+		if (!running(pid))
+			return false;
+
+		fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+		if (fd < 0)
+			return false;
+		ret = connect(fd, (struct sockaddr *) &sun, sizeof(sun));
+		close(fd);
+		if (!ret)
+			return true;
+	}
+
+	return false;
+}
+
+/* send probes until every consumer has seen one */
+static bool sinks_wait(struct sink *sinks, pid_t logd)
+{
+	int i, j, ready;
+
+	for (i = 0; i < 100; i++) {
+		if (!running(logd))
+			return false;
+
+		log_message(BENCH_PROBE, i);
+		usleep(100 * 1000);
+
+		for (j = ready = 0; j < consumers; j++) {
+			pthread_mutex_lock(&sinks[j].lock);
+			ready += sinks[j].ready;
+			pthread_mutex_unlock(&sinks[j].lock);
+		}
+		if (ready == consumers)
+			return true;
+	}
+
+	return false;
+}
+
+/* wait for the consumers to catch up, or for a second without progress */
+static void sinks_drain(struct sink *sinks, uint64_t sent)
+{
+	uint64_t total, last = 0;
+	int i, idle = 0;
+
+	while (idle < 10) {
+		usleep(100 * 1000);
+
+		for (i = 0, total = 0; i < consumers; i++) {
+			pthread_mutex_lock(&sinks[i].lock);
+			total += sinks[i].received;
+			pthread_mutex_unlock(&sinks[i].lock);
+		}
+		if (total == sent * consumers)
+			break;
+
+		idle = (total == last) ? idle + 1 : 0;
+		last = total;
+	}
+}
+
+struct proc_sample {
+	unsigned long utime, stime;	/* clock ticks */
+	unsigned long rss, max_rss;	/* kB */
+};
+
+static int proc_sample(pid_t pid, struct proc_sample *ps)
+{
+	char path[64], buf[1024], *p;
+	FILE *fp;
+	int ret = -1;
+
+	memset(ps, 0, sizeof(*ps));
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	if (fgets(buf, sizeof(buf), fp)) {
+		/* the command may contain spaces, the fields start after its ')' */
+		p = strrchr(buf, ')');
+		if (p && (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+				&ps->utime, &ps->stime) == 2))
+			ret = 0;
+	}
+	fclose(fp);
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return ret;
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (!strncmp(buf, "VmRSS:", 6))
+			ps->rss = strtoul(buf + 6, NULL, 10);
+		else if (!strncmp(buf, "VmHWM:", 6))
+			ps->max_rss = strtoul(buf + 6, NULL, 10);
+	}
+	fclose(fp);
+
+	return ret;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *v, size_t n, double p)
+{
+	size_t i;
+
+	if (!n)
+		return 0;
+
+	i = (size_t) (p * (n - 1) + 0.5);
+	return v[i] / 1000.0;
+}
+
+static void terminate(pid_t pid)
+{
+	if (pid <= 0)
+		return;
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv)
+{
+	struct producer *prod;
+	struct sink *sinks;
+	struct proc_sample before, after;
+	char size_arg[16];
+	char *logd_argv[] = { (char *) logd_path, "-S", size_arg, NULL };
+	uint64_t start, end, sent = 0;
+	double sec, cpu_sec, hz;
+	int ch, i, ret = 1;
+	pid_t logd;
+
+	while ((ch = getopt(argc, argv, "t:r:m:d:c:o:S:L:R:")) != -1) {
+		switch (ch) {
+		case 't':
+			producers = atoi(optarg);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 'm':
+			msg_size = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'c':
+			consumers = atoi(optarg);
+			break;
+		case 'o':
+			for (sink_mode = 0; sink_mode < ARRAY_SIZE(sink_modes); sink_mode++)
+				if (!strcmp(optarg, sink_modes[sink_mode]))
+					break;
+			if (sink_mode == ARRAY_SIZE(sink_modes))
+				return usage(*argv);
+			break;
+		case 'S':
+			log_size = atoi(optarg);
+			break;
+		case 'L':
+			logd_path = optarg;
+			break;
+		case 'R':
+			logread_path = optarg;
+			break;
+		default:
+			return usage(*argv);
+		}
+	}
+
+	if ((producers < 1) || (consumers < 1) || (rate < 0) || (duration < 1) ||
+	    (msg_size < 1) || (msg_size > BENCH_MSG_MAX) || (log_size < 1))
+		return usage(*argv);
+
+	logd_argv[0] = (char *) logd_path;
+	snprintf(size_arg, sizeof(size_arg), "%d", log_size);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	prod = calloc(producers, sizeof(*prod));
+	sinks = calloc(consumers, sizeof(*sinks));
+	if (!prod || !sinks)
+		return 1;
+	for (i = 0; i < consumers; i++)
+		sinks[i].fd = sinks[i].listen_fd = -1;
+
+	logd = spawn(logd_path, logd_argv, -1);
+	if ((logd < 0) || !logd_wait(logd)) {
+		fprintf(stderr, "logd did not come up, is another one running?\n");
+		goto out;
+	}
+
+	openlog(BENCH_TAG, LOG_NDELAY, LOG_USER);
+
+	for (i = 0; i < consumers; i++) {
+		pthread_mutex_init(&sinks[i].lock, NULL);
+		sinks[i].next_seq = calloc(producers, sizeof(*sinks[i].next_seq));
+		if (!sinks[i].next_seq || sink_start(&sinks[i])) {
+			fprintf(stderr, "failed to start consumer %d\n", i);
+			goto out;
+		}
+	}
+
+	if (!sinks_wait(sinks, logd)) {
+		fprintf(stderr, "consumers did not see the probe messages\n");
+		goto out;
+	}
+
+	proc_sample(logd, &before);
+	start = now_ns();
+	for (i = 0; i < producers; i++) {
+		prod[i].id = i;
+		if (pthread_create(&prod[i].thread, NULL, producer_run, &prod[i]))
+			goto out;
+	}
+
+	sleep(duration);
+	flag_set(stop);
+	for (i = 0; i < producers; i++) {
+		pthread_join(prod[i].thread, NULL);
+		sent += prod[i].sent;
+	}
+	end = now_ns();
+
+	sinks_drain(sinks, sent);
+	proc_sample(logd, &after);
+
+	sec = (end - start) / 1e9;
+	if (rate)
+		printf("%d producers x %d msg/s", producers, rate);
+	else
+		printf("%d producers at full speed", producers);
+	printf(", %d bytes, logd -S %d, %d %s consumers\n", msg_size, log_size,
+		consumers, sink_modes[sink_mode]);
+	printf("sent %llu messages in %.2fs, %.0f msg/s, %.1f MB/s\n",
+		(unsigned long long) sent, sec, sent / sec, sent * msg_size / sec / 1e6);
+
+	printf("%-5s %10s %9s %6s %10s %9s %9s %9s %9s\n", "sink", "received",
+		"drops", "dups", "msg/s", "p50 us", "p99 us", "p99.9 us", "max us");
+	for (i = 0; i < consumers; i++) {
+		struct sink *s = &sinks[i];
+		double span;
+
+		pthread_mutex_lock(&s->lock);
+		qsort(s->lat, s->lat_n, sizeof(*s->lat), cmp_u64);
+		span = (s->last_ns > s->first_ns) ? (s->last_ns - s->first_ns) / 1e9 : 0;
+		printf("%-5d %10llu %9llu %6llu %10.0f %9.1f %9.1f %9.1f %9.1f\n", i,
+			(unsigned long long) s->received,
+			(unsigned long long) (sent - s->received),
+			(unsigned long long) s->dups,
+			span ? s->received / span : 0,
+			percentile_us(s->lat, s->lat_n, 0.5),
+			percentile_us(s->lat, s->lat_n, 0.99),
+			percentile_us(s->lat, s->lat_n, 0.999),
+			s->lat_n ? s->lat[s->lat_n - 1] / 1000.0 : 0);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	hz = sysconf(_SC_CLK_TCK);
+	cpu_sec = ((after.utime - before.utime) + (after.stime - before.stime)) / hz;
+	printf("logd cpu %.1f%% (user %.2fs, sys %.2fs), rss %lu kB, max rss %lu kB\n",
+		cpu_sec / sec * 100, (after.utime - before.utime) / hz,
+		(after.stime - before.stime) / hz, after.rss, after.max_rss);
+
+	ret = 0;
+
+out:
+	flag_set(stop);
+	for (i = 0; i < consumers; i++)
+		terminate(sinks[i].pid);
+	flag_set(sinks_done);
+	for (i = 0; i < consumers; i++) {
+		if (sinks[i].started)
+			pthread_join(sinks[i].thread, NULL);
+		if (sinks[i].fd >= 0)
+			close(sinks[i].fd);
+		if (sinks[i].listen_fd >= 0)
+			close(sinks[i].listen_fd);
+		if (sinks[i].path[0])
+			unlink(sinks[i].path);
+		free(sinks[i].next_seq);
+		free(sinks[i].lat);
+	}
+	terminate(logd);
+	closelog();
+	free(sinks);
+	free(prod);
+
+	return ret;
+}
@@ -0,0 +1,196 @@
+/*
+ * Compare the timestamp formatting used by logread with the plain
+ * implementations: timestamp_format_cached() against
+ * timestamp_format_precision(), and the local time lookup with
+ * timestamp_format_ctime() against ctime_r(). Both outputs are checked
+ * for every timestamp of a generated log stream.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../rfc3339/timestamp.h"
+
+/* 2024-03-31T00:00:00Z, two hours before the EU switch to summer time */
+#define BENCH_START	1711843200
+
+/* same as log_tz_offset() in logread.c */
+static long tz_offset(time_t t)
+{
+	static bool cached;
+	static time_t last;
+	static long offset;
+	struct tm tm;
+
+	if (!cached || t != last) {
+		if (!localtime_r(&t, &tm))
+			return 0;
+		offset = tm.tm_gmtoff;
+		last = t;
+		cached = true;
+	}
+
+	return offset;
+}
+
+static int usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"Options:\n"
+		"    -n <count>		Timestamps in the stream (default 1000000)\n"
+		"    -g <msecs>		Largest gap between two timestamps (default 50)\n"
+		"    -s <secs>		First timestamp (default %d)\n"
+		"\n"
+		"The local time follows TZ, e.g. TZ=Europe/Berlin covers a\n"
+		"transition with the default start.\n", prog, BENCH_START);
+	return 1;
+}
+
+static double elapsed_ns(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char **argv)
+{
+	char buf[64], ref[64];
+	struct timespec start;
+	timestamp_cache_t cache = { 0 };
+	timestamp_t ts = { 0 };
+	int64_t *stream, t_ms;
+	int count = 1000000, gap = 50, failed = 0;
+	int64_t first = BENCH_START;
+	volatile size_t sink = 0;
+	double t_new, t_old;
+	time_t t;
+	long off;
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "n:g:s:")) != -1) {
+		switch (ch) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'g':
+			gap = atoi(optarg);
+			break;
+		case 's':
+			first = strtoll(optarg, NULL, 10);
+			break;
+		default:
+			return usage(*argv);
+		}
+	}
+
+	if ((count < 1) || (gap < 0))
+		return usage(*argv);
+
+	stream = calloc(count, sizeof(*stream));
+	if (!stream)
+		return 1;
+
+	tzset();
+	srand(1);
+	for (i = 0, t_ms = first * 1000; i < count; i++) {
+		stream[i] = t_ms;
+		t_ms += gap ? rand() % (gap + 1) : 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		ts.sec = stream[i] / 1000;
+		ts.nsec = (stream[i] % 1000) * 1000000;
+		ts.offset = 0;
+		if (!timestamp_format_cached(&cache, buf, sizeof(buf), &ts, 3))
+			buf[0] = '\0';
+		if (!timestamp_format_precision(ref, sizeof(ref), &ts, 3))
+			ref[0] = '\0';
+		if (strcmp(buf, ref)) {
+			printf("FAIL cached %s, expected %s\n", buf, ref);
+			failed++;
+		}
+
+		t = ts.sec;
+		off = tz_offset(t);
+		ts.sec = t + off % 60;
+		ts.nsec = 0;
+		ts.offset = off / 60;
+		if (!timestamp_format_ctime(buf, sizeof(buf), &ts))
+			buf[0] = '\0';
+		ctime_r(&t, ref);
+		ref[strcspn(ref, "\n")] = '\0';
+		if (strcmp(buf, ref)) {
+			printf("FAIL ctime %s, expected %s\n", buf, ref);
+			failed++;
+		}
+
+		if (failed > 10)
+			break;
+	}
+
+	printf("%d timestamps from %lld, up to %d ms apart\n", count, (long long) first, gap);
+	printf("%-10s %10s %10s %8s\n", "format", "new ns", "old ns", "speedup");
+
+	memset(&cache, 0, sizeof(cache));
+	ts.offset = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		ts.sec = stream[i] / 1000;
+		ts.nsec = (stream[i] % 1000) * 1000000;
+		sink += timestamp_format_cached(&cache, buf, sizeof(buf), &ts, 3);
+	}
+	t_new = elapsed_ns(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		ts.sec = stream[i] / 1000;
+		ts.nsec = (stream[i] % 1000) * 1000000;
+		sink += timestamp_format_precision(buf, sizeof(buf), &ts, 3);
+	}
+	t_old = elapsed_ns(&start);
+
+	printf("%-10s %10.1f %10.1f %7.2fx\n", "rfc3339", t_new / count, t_old / count, t_old / t_new);
+
+	ts.nsec = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		t = stream[i] / 1000;
+		off = tz_offset(t);
+		ts.sec = t + off % 60;
+		ts.offset = off / 60;
+		sink += timestamp_format_ctime(buf, sizeof(buf), &ts);
+	}
+	t_new = elapsed_ns(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		t = stream[i] / 1000;
+		sink += !!ctime_r(&t, buf);
+	}
+	t_old = elapsed_ns(&start);
+
+	printf("%-10s %10.1f %10.1f %7.2fx\n", "ctime", t_new / count, t_old / count, t_old / t_new);
+
+	free(stream);
+
+	if (failed)
+		printf("%d failures\n", failed);
+
+	return !!failed;
+}
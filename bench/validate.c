@@ -0,0 +1,166 @@
+/*
+ * Run a table of datatype expressions and values through libvalidate,
+ * check the results and report the time per validation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../validate/libvalidate.h"
+
+#define BENCH_VALUES	6
+
+static const struct {
+	const char *expr;
+	const char *values[2][BENCH_VALUES];	/* valid, then invalid ones */
+} cases[] = {
+	{ "integer", { { "0", "-12", "123456" }, { "1.5", "abc", "12x", "-" } } },
+	{ "uinteger", { { "0", "42", "4294967295" }, { "-1", "1e3", "x" } } },
+	{ "float", { { "1.5", "-0.25", "3", "1e300", "inf" }, { "1.2.3", "abc", "1,5" } } },
+	{ "ufloat", { { "1.5", "0", "12.75", "1e300", "inf" }, { "-1.5", "-0.5", "x1" } } },
+	{ "bool", { { "1", "yes", "off", "true", "disabled" }, { "2", "maybe", "y" } } },
+	{ "string", { { "foo", "a b c", "1" } } },
+	{ "hexstring", { { "00ff", "deadBEEF" }, { "abc", "xyz0", "0x00" } } },
+	{ "ipaddr", { { "192.168.1.1", "fe80::1", "::" }, { "1.2.3", "fe80:::1", "host" } } },
+	{ "cidr", { { "10.0.0.0/8", "2001:db8::/32", "1.2.3.4" }, { "10.0.0.0/33", "::/129" } } },
+	{ "ipmask", { { "10.0.0.1/255.0.0.0", "2001:db8::1/ffff::" }, { "10.0.0.1/255.0.255.0" } } },
+	{ "port", { { "0", "22", "65535" }, { "65536", "1e3", "ssh" } } },
+	{ "portrange", { { "1-1024", "80-80" }, { "1024-1", "1-65536", "80" } } },
+	{ "macaddr", { { "00:11:22:33:44:55", "aa:bb:cc:dd:ee:ff" }, { "00:11:22:33:44", "00-11-22-33-44-55" } } },
+	{ "uciname", { { "lan", "wan_6", "UPPER" }, { "br-lan", "a.b", "a b" } } },
+	{ "wpakey", { { "password", "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef" }, { "short", "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdeX" } } },
+	{ "wepkey", { { "12345", "s:1234567890123", "0123456789" }, { "1234", "012345678g" } } },
+	{ "hostname", { { "openwrt", "downloads.openwrt.org", "a-b_c" }, { "a..b", "under score", ".lan" } } },
+	{ "host", { { "openwrt.org", "10.0.0.1", "::1" }, { "a..b", "foo bar" } } },
+	{ "network", { { "lan", "br-lan" }, { "a..b", "a b" } } },
+	{ "phonedigit", { { "0123456789", "*#" }, { "123a", "+49" } } },
+	{ "directory", { { "/", "/tmp" }, { "/nonexistent/dir" } } },
+	{ "device", { { "/dev/null" }, { "/tmp", "/nonexistent" } } },
+	{ "min(10)", { { "10", "100" }, { "9", "x" } } },
+	{ "max(10)", { { "10", "-5" }, { "11" } } },
+	{ "range(10,20)", { { "10", "15", "20" }, { "9", "21" } } },
+	{ "minlength(3)", { { "abc", "abcdef" }, { "ab" } } },
+	{ "maxlength(3)", { { "a", "abc" }, { "abcd" } } },
+	{ "rangelength(2,4)", { { "ab", "abcd" }, { "a", "abcde" } } },
+	{ "regex('^[a-z]+$')", { { "abc", "z" }, { "ABC", "a1" } } },
+	{ "or(port,portrange)", { { "22", "1-1024" }, { "ssh", "1024-1" } } },
+	{ "and(uinteger,max(100))", { { "0", "100" }, { "101", "-1" } } },
+	{ "list(uinteger)", { { "1 2 3", "42" }, { "1 -2", "1 x" } } },
+	{ "list(macaddr)", { { "00:11:22:33:44:55 aa:bb:cc:dd:ee:ff", "00:11:22:33:44:55" }, { "00:11:22:33:44:55 xx" } } },
+	{ "list(or(ip4addr,cidr4))", { { "10.0.0.1 10.0.0.0/8" }, { "10.0.0.1 ::1" } } },
+	{ "or(hostname,'any')", { { "any", "lan.host" }, { "a b" } } },
+};
+
+#define NCASES	(sizeof(cases) / sizeof(cases[0]))
+
+static int usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"Options:\n"
+		"    -n <count>		Passes over the table for the timings (default 20000)\n", prog);
+	return 1;
+}
+
+static double elapsed_ns(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+static int check_case(int i, struct dt_code *code)
+{
+	const char *v;
+	int failed = 0, j, k;
+
+	for (k = 0; k < 2; k++) {
+		for (j = 0; j < BENCH_VALUES && (v = cases[i].values[k][j]); j++) {
+			if ((dt_parse(cases[i].expr, v) == DT_INVALID) != k) {
+				printf("FAIL dt_parse(%s, '%s') should be %s\n", cases[i].expr, v, k ? "invalid" : "valid");
+				failed++;
+			}
+			if ((dt_check(code, v) == DT_INVALID) != k) {
+				printf("FAIL dt_check(%s, '%s') should be %s\n", cases[i].expr, v, k ? "invalid" : "valid");
+				failed++;
+			}
+		}
+	}
+
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec start;
+	struct dt_code *code;
+	int passes = 20000, failed = 0;
+	int ch, i, j, k, n, count;
+	volatile int sink = 0;
+	double t_parse, t_check;
+	const char *v;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			passes = atoi(optarg);
+			break;
+		default:
+			return usage(*argv);
+		}
+	}
+
+	if (passes < 1)
+		return usage(*argv);
+
+	printf("%-26s %6s %12s %12s\n", "expression", "values", "dt_parse ns", "dt_check ns");
+	for (i = 0; i < NCASES; i++) {
+		code = dt_compile(cases[i].expr);
+		if (!code) {
+			printf("FAIL cannot compile %s\n", cases[i].expr);
+			failed++;
+			continue;
+		}
+
+		failed += check_case(i, code);
+
+		for (k = count = 0; k < 2; k++)
+			for (j = 0; j < BENCH_VALUES && cases[i].values[k][j]; j++)
+				count++;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (n = 0; n < passes; n++)
+			for (k = 0; k < 2; k++)
+				for (j = 0; j < BENCH_VALUES && (v = cases[i].values[k][j]); j++)
+					sink += dt_parse(cases[i].expr, v);
+		t_parse = elapsed_ns(&start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (n = 0; n < passes; n++)
+			for (k = 0; k < 2; k++)
+				for (j = 0; j < BENCH_VALUES && (v = cases[i].values[k][j]); j++)
+					sink += dt_check(code, v);
+		t_check = elapsed_ns(&start);
+
+		printf("%-26s %6d %12.1f %12.1f\n", cases[i].expr, count,
+			t_parse / passes / count, t_check / passes / count);
+		dt_free(code);
+	}
+
+	if (failed)
+		printf("%d failures\n", failed);
+
+	return !!failed;
+}
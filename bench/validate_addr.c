@@ -0,0 +1,364 @@
+/*
+ * Check the address validators against a corpus and compare their speed
+ * with the inet_pton()/ether_aton() based implementations they replaced.
+ * validate.c is included to time its dt_type_*() functions directly, the
+ * results are checked through dt_parse().
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/ether.h>
+
+#include "../validate/validate.c"
+
+#define BENCH_LINE_LEN	256
+
+/* the validators as they were before the single pass scanners */
+
+static bool ref_ip4addr(const char *v)
+{
+	struct in6_addr a;
+	return inet_pton(AF_INET, v, &a);
+}
+
+static bool ref_ip6addr(const char *v)
+{
+	struct in6_addr a;
+	return inet_pton(AF_INET6, v, &a);
+}
+
+static bool ref_netmask4(const char *v)
+{
+	int i;
+	struct in_addr a;
+
+	if (!inet_pton(AF_INET, v, &a))
+		return false;
+
+	if (a.s_addr == 0)
+		return true;
+
+	a.s_addr = ntohl(a.s_addr);
+
+	for (i = 0; (i < 32) && !(a.s_addr & (1 << i)); i++);
+
+	return ((uint32_t)(~((1 << i) - 1)) == a.s_addr);
+}
+
+static bool ref_netmask6(const char *v)
+{
+	int i;
+	struct in6_addr a;
+
+	if (!inet_pton(AF_INET6, v, &a))
+		return false;
+
+	for (i = 0; (i < 16) && (a.s6_addr[i] == 0xFF); i++);
+
+	if (i == 16)
+		return true;
+
+	if ((a.s6_addr[i] != 255) && (a.s6_addr[i] != 254) &&
+		(a.s6_addr[i] != 252) && (a.s6_addr[i] != 248) &&
+		(a.s6_addr[i] != 240) && (a.s6_addr[i] != 224) &&
+		(a.s6_addr[i] != 192) && (a.s6_addr[i] != 128) &&
+		(a.s6_addr[i] != 0))
+		return false;
+
+	for (; (i < 16) && (a.s6_addr[i] == 0); i++);
+
+	return (i == 16);
+}
+
+static bool ref_cidr(const char *v, int af, unsigned int max)
+{
+	struct in6_addr a;
+	unsigned long n;
+	char *p, buf[sizeof("FFFF:FFFF:FFFF:FFFF:FFFF:FFFF:255.255.255.255/128\0")];
+
+	if (strlen(v) >= ((af == AF_INET) ? sizeof("255.255.255.255/32\0") : sizeof(buf)))
+		return false;
+
+	strcpy(buf, v);
+	p = strchr(buf, '/');
+	if (p) {
+		*p++ = 0;
+		n = strtoul(p, &p, 10);
+		if ((*p != 0) || (n > max))
+			return false;
+	}
+
+	return inet_pton(af, buf, &a);
+}
+
+static bool ref_cidr4(const char *v)
+{
+	return ref_cidr(v, AF_INET, 32);
+}
+
+static bool ref_cidr6(const char *v)
+{
+	return ref_cidr(v, AF_INET6, 128);
+}
+
+static bool ref_ipmask(const char *v, int af, bool (*netmask)(const char *))
+{
+	struct in6_addr a;
+	char *p, buf[sizeof("FFFF:FFFF:FFFF:FFFF:FFFF:FFFF:255.255.255.255/"
+	                    "FFFF:FFFF:FFFF:FFFF:FFFF:FFFF:255.255.255.255\0")];
+
+	if (strlen(v) >= ((af == AF_INET) ? sizeof("255.255.255.255/255.255.255.255\0") : sizeof(buf)))
+		return false;
+
+	strcpy(buf, v);
+	p = strchr(buf, '/');
+	if (p) {
+		*p++ = 0;
+		if (!netmask(p))
+			return false;
+	}
+
+	return inet_pton(af, buf, &a);
+}
+
+static bool ref_ipmask4(const char *v)
+{
+	return ref_ipmask(v, AF_INET, ref_netmask4);
+}
+
+static bool ref_ipmask6(const char *v)
+{
+	return ref_ipmask(v, AF_INET6, ref_netmask6);
+}
+
+static bool ref_macaddr(const char *v)
+{
+	return !!ether_aton(v);
+}
+
+static bool ref_hostname(const char *v)
+{
+	const char *p, *last;
+
+	for (p = last = v; *p; p++) {
+		if (*p == '.') {
+			if ((p - last) == 0 || (p - last) > 63)
+				return false;
+			last = p + 1;
+			continue;
+		} else if ((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z') ||
+		           (*p >= '0' && *p <= '9') || (*p == '_') || (*p == '-')) {
+			continue;
+		}
+
+		return false;
+	}
+
+	return ((p - last) > 0 && (p - last) <= 255);
+}
+
+static const struct {
+	const char *type;
+	bool (*ref)(const char *v);
+	bool (*cur)(struct dt_state *s, int nargs);
+} types[] = {
+	{ "ip4addr", ref_ip4addr, dt_type_ip4addr },
+	{ "ip6addr", ref_ip6addr, dt_type_ip6addr },
+	{ "netmask4", ref_netmask4, dt_type_netmask4 },
+	{ "netmask6", ref_netmask6, dt_type_netmask6 },
+	{ "cidr4", ref_cidr4, dt_type_cidr4 },
+	{ "cidr6", ref_cidr6, dt_type_cidr6 },
+	{ "ipmask4", ref_ipmask4, dt_type_ipmask4 },
+	{ "ipmask6", ref_ipmask6, dt_type_ipmask6 },
+	{ "macaddr", ref_macaddr, dt_type_macaddr },
+	{ "hostname", ref_hostname, dt_type_hostname },
+};
+
+#define NTYPES	(sizeof(types) / sizeof(types[0]))
+
+struct sample {
+	int type;
+	bool valid;
+	bool changed;	/* the old implementation returned the opposite */
+	char *value;
+};
+
+static int usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options] <corpus>\n"
+		"Options:\n"
+		"    -n <count>		Passes over the corpus for the timings (default 2000)\n"
+		"\n"
+		"Each corpus line is \"<type> <result> <value>\", the result is + for\n"
+		"valid or - for invalid, followed by ! if the old implementation\n"
+		"returned the opposite on purpose.\n", prog);
+	return 1;
+}
+
+static int load_corpus(const char *path, struct sample **samples)
+{
+	char buf[BENCH_LINE_LEN], type[16], res[4];
+	struct sample *s = NULL;
+	int n = 0, off, i;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, "failed to open %s\n", path);
+		return -1;
+	}
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		buf[strcspn(buf, "\n")] = '\0';
+		if (!buf[0] || (buf[0] == '#'))
+			continue;
+
+		if ((sscanf(buf, "%15s %3s %n", type, res, &off) < 2) ||
+		    ((res[0] != '+') && (res[0] != '-'))) {
+			fprintf(stderr, "bad corpus line: %s\n", buf);
+			continue;
+		}
+
+		for (i = 0; i < NTYPES; i++)
+			if (!strcmp(types[i].type, type))
+				break;
+		if (i == NTYPES) {
+			fprintf(stderr, "unknown type: %s\n", type);
+			continue;
+		}
+
+		if (!(n % 256)) {
+			s = realloc(s, (n + 256) * sizeof(*s));
+			if (!s) {
+				fclose(fp);
+				return -1;
+			}
+		}
+		s[n].type = i;
+		s[n].valid = (res[0] == '+');
+		s[n].changed = (res[1] == '!');
+		s[n].value = strdup(buf + off);
+		n++;
+	}
+	fclose(fp);
+
+	*samples = s;
+	return n;
+}
+
+static double elapsed_ns(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char **argv)
+{
+	struct sample *samples;
+	const char **values;
+	struct timespec start;
+	struct dt_state s = { 0 };
+	int passes = 2000, failed = 0;
+	int ch, i, j, k, n, count;
+	volatile int sink = 0;
+	double t_new, t_old;
+	bool res;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			passes = atoi(optarg);
+			break;
+		default:
+			return usage(*argv);
+		}
+	}
+
+	if ((optind != argc - 1) || (passes < 1))
+		return usage(*argv);
+
+	n = load_corpus(argv[optind], &samples);
+	if (n <= 0) {
+		fprintf(stderr, "no samples in %s\n", argv[optind]);
+		return 1;
+	}
+
+	/* the expected results, and the intended differences to the old code */
+	for (i = 0; i < n; i++) {
+		res = (dt_parse(types[samples[i].type].type, samples[i].value) != DT_INVALID);
+		if (res != samples[i].valid) {
+			printf("FAIL %s '%s': %s, expected %s\n", types[samples[i].type].type,
+				samples[i].value, res ? "valid" : "invalid",
+				samples[i].valid ? "valid" : "invalid");
+			failed++;
+		}
+
+		res = types[samples[i].type].ref(samples[i].value);
+		if ((res != samples[i].valid) != samples[i].changed) {
+			printf("FAIL %s '%s': old implementation %s, corpus says %s\n",
+				types[samples[i].type].type, samples[i].value,
+				res ? "valid" : "invalid",
+				samples[i].changed ? "it differs" : "it agrees");
+			failed++;
+		}
+	}
+
+	values = calloc(n, sizeof(*values));
+	if (!values)
+		return 1;
+
+	printf("%-10s %7s %10s %10s %8s\n", "type", "values", "new ns", "old ns", "speedup");
+	for (k = 0; k < NTYPES; k++) {
+		for (i = count = 0; i < n; i++)
+			if (samples[i].type == k)
+				values[count++] = samples[i].value;
+		if (!count)
+			continue;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (j = 0; j < passes; j++) {
+			for (i = 0; i < count; i++) {
+				s.value = values[i];
+				sink += types[k].cur(&s, 0);
+			}
+		}
+		t_new = elapsed_ns(&start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (j = 0; j < passes; j++)
+			for (i = 0; i < count; i++)
+				sink += types[k].ref(values[i]);
+		t_old = elapsed_ns(&start);
+
+		printf("%-10s %7d %10.1f %10.1f %7.2fx\n", types[k].type, count,
+			t_new / passes / count, t_old / passes / count, t_old / t_new);
+	}
+
+	for (i = 0; i < n; i++)
+		free(samples[i].value);
+	free(samples);
+	free(values);
+
+	if (failed)
+		printf("%d failures\n", failed);
+
+	return !!failed;
+}
@@ -0,0 +1,50 @@
+/*
+ * libFuzzer entry point for the libvalidate expression compiler. The input
+ * up to the first newline is compiled as an expression, the rest of it is
+ * checked as a value against the result.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../validate/libvalidate.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct dt_code *code;
+	char *expr, *value;
+
+	expr = malloc(size + 1);
+	if (!expr)
+		return 0;
+
+	memcpy(expr, data, size);
+	expr[size] = '\0';
+
+	value = strchr(expr, '\n');
+	if (value)
+		*value++ = '\0';
+
+	code = dt_compile(expr);
+	if (code) {
+		/* uci() would look up the configuration of the host */
+		if (value && !strstr(expr, "uci"))
+			dt_check(code, value);
+		dt_free(code);
+	}
+
+	free(expr);
+	return 0;
+}
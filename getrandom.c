@@ -12,8 +12,10 @@
  * GNU General Public License for more details.
  */
 #define _GNU_SOURCE
+#include <ctype.h>
 #include <errno.h>
 #include <linux/random.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,35 +27,127 @@
 		return EXIT_FAILURE; \
 	} while (0)
 
+#define BUF_SIZE	(64 * 1024)
+
+static char buf[BUF_SIZE];
+
 static int usage(char *name)
 {
-	fprintf(stderr, "Usage: %s <nb>\n", name);
+	fprintf(stderr, "Usage: %s [-n] <nb>[K|M|G]\n", name);
 	fprintf(stderr, " => return <nb> bytes from getrandom()\n");
+	fprintf(stderr, " -n: fail instead of blocking if the entropy pool is not initialized\n");
 	return EXIT_FAILURE;
 }
 
+static int parse_size(const char *str, uint64_t *size)
+{
+	unsigned long long val;
+	unsigned int shift = 0;
+	char *end;
+
+	if (!isdigit(*str))
+		return -1;
+
+	errno = 0;
+	val = strtoull(str, &end, 10);
+	if (errno)
+		return -1;
+
+	switch (*end) {
+	case 'G':
+	case 'g':
+		shift += 10;
+		/* fall through */
+	case 'M':
+	case 'm':
+		shift += 10;
+		/* fall through */
+	case 'K':
+	case 'k':
+		shift += 10;
+		end++;
+		break;
+	}
+
+	if (*end || val > (UINT64_MAX >> shift))
+		return -1;
+
+	*size = (uint64_t) val << shift;
+	return 0;
+}
+
+static int fill_random(char *p, size_t len, unsigned int flags)
+{
+	long ret;
+
+	while (len > 0) {
+		ret = syscall(SYS_getrandom, p, len, flags);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int write_all(const char *p, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(STDOUT_FILENO, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc != 2)
+	unsigned int flags = 0;
+	uint64_t nbtot;
+	size_t len;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n")) != -1) {
+		switch (ch) {
+		case 'n':
+			flags |= GRND_NONBLOCK;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 1)
 		return usage(argv[0]);
 
 	if (isatty(STDOUT_FILENO))
 		ERROR_EXIT("Not outputting random to a tty\n");
 
-	int nbtot = atoi(argv[1]);
-	if (nbtot < 1)
+	if (parse_size(argv[optind], &nbtot) || nbtot < 1)
 		ERROR_EXIT("Invalid <nb> param (must be > 0)\n");
 
-	char buf[256];
-	int len = sizeof(buf);
 	while (nbtot > 0) {
-		if (nbtot <= sizeof(buf))
-			len = nbtot;
-		if (syscall(SYS_getrandom, buf, len, 0) == -1)
+		len = (nbtot < sizeof(buf)) ? nbtot : sizeof(buf);
+		if (fill_random(buf, len, flags)) {
+			if (errno == EAGAIN)
+				ERROR_EXIT("getrandom() failed: entropy pool not initialized\n");
 			ERROR_EXIT("getrandom() failed: %s\n", strerror(errno));
-		if (write(STDOUT_FILENO, buf, len) != len)
+		}
+		if (write_all(buf, len))
 			ERROR_EXIT("write() failed: %s\n", strerror(errno));
-		nbtot -= sizeof(buf);
+		nbtot -= len;
 	}
 
 	return 0;
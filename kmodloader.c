@@ -16,6 +16,8 @@
 #include <sys/syscall.h>
 #include <sys/mman.h>
 #include <sys/utsname.h>
+#include <sys/wait.h>
+#include <time.h>
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -23,6 +25,7 @@
 #include <sys/types.h>
 #include <values.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -31,12 +34,19 @@
 #include <glob.h>
 #include <elf.h>
 
-#include <libubox/avl.h>
-#include <libubox/avl-cmp.h>
+#include <libubox/list.h>
 #include <libubox/utils.h>
 #include <libubox/ulog.h>
 
 #define DEF_MOD_PATH "/modules/%s/"
+#define MOD_INDEX "modules.idx"
+#define MOD_INDEX_MAGIC 0x6b6d6978
+#define MOD_INDEX_VERSION 1
+#define MOD_HASH_SIZE 512
+
+#ifndef MODULE_INIT_COMPRESSED_FILE
+#define MODULE_INIT_COMPRESSED_FILE 4
+#endif
 
 enum {
 	SCANNED,
@@ -45,24 +55,85 @@ enum {
 };
 
 struct module {
+	struct list_head list;
+	struct module *hnext;		/* next module in the same hash bucket */
+	uint32_t hash;
+
 	char *name;
 	char *depends;
 	char *opts;
 
+	struct module **deps;		/* resolved depends, NULL if missing */
+	int ndeps;
+	int deps_gen;			/* module_gen the deps were resolved at */
+	struct module_alias *aliases;
+
 	int size;
 	int usage;
 	int state;
 	int error;
-	int refcnt;			/* number of references from module_node.m */
+
+	int pending;			/* dependencies that are not loaded yet */
+	pid_t pid;			/* worker inserting the module */
+	int worker;			/* slot of that worker */
+	struct module **dependents;	/* modules waiting for this one */
+	int ndependents;
+	int maxdependents;
+
+	/* profiling, in microseconds since profile_start */
+	uint64_t t_scan, t_scan_end;
+	uint64_t t_ready, t_start, t_done;
+	int pass;
 };
 
-struct module_node {
-	struct avl_node avl;
+struct module_alias {
+	struct module_alias *hnext;	/* next alias in the same hash bucket */
+	struct module_alias *next;	/* next alias of the same module */
 	struct module *m;
-	bool is_alias;
+	uint32_t hash;
+	char *name;
 };
 
-static struct avl_tree modules;
+/*
+ * modules.idx, one per module folder: the header is followed by count
+ * entries and a block of NUL terminated strings the entries point into.
+ * The folder's inode and mtime tell whether the index is still valid.
+ */
+struct module_index {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t dir_ino;
+	int64_t dir_mtime;
+	int64_t dir_mtime_nsec;
+	uint32_t count;
+	uint32_t strings;
+};
+
+struct module_index_entry {
+	uint32_t name;
+	uint32_t depends;		/* UINT32_MAX if there are none */
+	uint32_t aliases;		/* naliases consecutive strings */
+	uint32_t naliases;
+	uint32_t size;
+};
+
+/* module file name suffixes, and the tool decompressing them */
+static const struct {
+	const char *ext;
+	const char *cmd;
+} module_ext[] = {
+	{ ".ko", NULL },
+	{ ".ko.xz", "xz" },
+	{ ".ko.zst", "zstd" },
+};
+
+static LIST_HEAD(modules);
+static int nmodules;
+static int module_gen;		/* bumped whenever a module is added */
+static struct module *module_hash[MOD_HASH_SIZE];
+static struct module_alias *alias_hash[MOD_HASH_SIZE];
+
+static uint64_t profile_start;
 
 static char **module_folders = NULL;
 
@@ -111,28 +182,71 @@ static int init_module_folders(void)
 	return 0;
 }
 
+static uint64_t profile_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - profile_start;
+}
+
+/* module names treat '-' and '_' as the same character */
+static inline char weight(char c)
+{
+	return c == '_' ? '-' : c;
+}
+
+static uint32_t mod_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	while (*name) {
+		h ^= (unsigned char) weight(*name++);
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static bool mod_name_eq(const char *s1, const char *s2)
+{
+	while (*s1 && (weight(*s1) == weight(*s2))) {
+		s1++;
+		s2++;
+	}
+
+	return weight(*s1) == weight(*s2);
+}
+
 static struct module *find_module(const char *name)
 {
-	struct module_node *mn;
-	mn = avl_find_element(&modules, name, mn, avl);
-	if (mn)
-		return mn->m;
-	else
-		return NULL;
+	uint32_t h = mod_hash(name);
+	struct module_alias *a;
+	struct module *m;
+
+	for (m = module_hash[h % MOD_HASH_SIZE]; m; m = m->hnext)
+		if ((m->hash == h) && mod_name_eq(m->name, name))
+			return m;
+
+	for (a = alias_hash[h % MOD_HASH_SIZE]; a; a = a->hnext)
+		if ((a->hash == h) && mod_name_eq(a->name, name))
+			return a->m;
+
+	return NULL;
 }
 
 static void free_modules(void)
 {
-	struct module_node *mn, *tmp;
+	struct module *m, *tmp;
 
-	avl_remove_all_elements(&modules, mn, avl, tmp) {
-		struct module *m = mn->m;
+	list_for_each_entry_safe(m, tmp, &modules, list)
+		free_module(m);
 
-		m->refcnt -= 1;
-		if (m->refcnt == 0)
-			free_module(m);
-		free(mn);
-	}
+	INIT_LIST_HEAD(&modules);
+	memset(module_hash, 0, sizeof(module_hash));
+	memset(alias_hash, 0, sizeof(alias_hash));
+	nmodules = 0;
 }
 
 static char* get_module_path(char *name)
@@ -140,19 +254,99 @@ static char* get_module_path(char *name)
 	char **p;
 	static char path[256];
 	struct stat s;
+	int i;
 
 	if (!stat(name, &s) && S_ISREG(s.st_mode))
 		return name;
 
 	for (p = module_folders; *p; p++) {
-		snprintf(path, sizeof(path), "%s%s.ko", *p, name);
-		if (!stat(path, &s) && S_ISREG(s.st_mode))
-			return path;
+		for (i = 0; i < ARRAY_SIZE(module_ext); i++) {
+			snprintf(path, sizeof(path), "%s%s%s", *p, name, module_ext[i].ext);
+			if (!stat(path, &s) && S_ISREG(s.st_mode))
+				return path;
+		}
 	}
 
 	return NULL;
 }
 
+static int get_module_ext(const char *path)
+{
+	int i, len = strlen(path);
+
+	for (i = ARRAY_SIZE(module_ext) - 1; i >= 0; i--) {
+		int n = strlen(module_ext[i].ext);
+
+		if ((len > n) && !strcmp(path + len - n, module_ext[i].ext))
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Decompress a module into a memfd by piping it through the matching tool,
+ * so that compressed modules can be parsed and handed to finit_module()
+ * without holding a copy on the heap.
+ */
+static int decompress_module(const char *path, int fd)
+{
+	const char *cmd = module_ext[get_module_ext(path)].cmd;
+	int out, status;
+	pid_t pid;
+
+	out = memfd_create("kmodloader", MFD_CLOEXEC);
+	if (out < 0) {
+		ULOG_ERR("failed to create memfd for %s\n", path);
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		close(out);
+		return -1;
+	}
+
+	if (!pid) {
+		if ((lseek(fd, 0, SEEK_SET) < 0) ||
+		    (dup2(fd, STDIN_FILENO) < 0) ||
+		    (dup2(out, STDOUT_FILENO) < 0))
+			_exit(127);
+		execlp(cmd, cmd, "-dc", NULL);
+		_exit(127);
+	}
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			status = -1;
+			break;
+		}
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		ULOG_ERR("failed to decompress %s with %s\n", path, cmd);
+		close(out);
+		return -1;
+	}
+
+	return out;
+}
+
+/* open a module, returning an fd on its uncompressed contents */
+static int open_module(const char *path)
+{
+	int fd, out;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if ((fd < 0) || (get_module_ext(path) <= 0))
+		return fd;
+
+	out = decompress_module(path, fd);
+	close(fd);
+
+	return out;
+}
+
 static char* get_module_name(char *path)
 {
 	static char name[32];
@@ -225,22 +419,22 @@ static int elf_find_section(char *map, const char *section, unsigned int *offset
 	return -1;
 }
 
-static struct module_node *
-alloc_module_node(const char *name, struct module *m, bool is_alias)
+static struct module_alias *
+alloc_module_alias(const char *name, struct module *m)
 {
-	struct module_node *mn;
+	struct module_alias *a;
 	char *_name;
 
-	mn = calloc_a(sizeof(*mn),
+	a = calloc_a(sizeof(*a),
 		&_name, strlen(name) + 1);
-	if (mn) {
-		mn->avl.key = strcpy(_name, name);
-		mn->m = m;
-		mn->is_alias = is_alias;
-		avl_insert(&modules, &mn->avl);
-		m->refcnt += 1;
+	if (a) {
+		a->name = strcpy(_name, name);
+		a->hash = mod_hash(name);
+		a->m = m;
+		a->hnext = alias_hash[a->hash % MOD_HASH_SIZE];
+		alias_hash[a->hash % MOD_HASH_SIZE] = a;
 	}
-	return mn;
+	return a;
 }
 
 static struct module *
@@ -269,21 +463,72 @@ alloc_module(const char *name, const char * const *aliases, int naliases, const
 	}
 	m->size = size;
 
-	m->refcnt = 0;
-	alloc_module_node(m->name, m, false);
-	for (i = 0; i < naliases; i++)
-		alloc_module_node(aliases[i], m, true);
+	m->hash = mod_hash(name);
+	m->hnext = module_hash[m->hash % MOD_HASH_SIZE];
+	module_hash[m->hash % MOD_HASH_SIZE] = m;
+	list_add_tail(&m->list, &modules);
+	nmodules++;
+	module_gen++;
+
+	/* keep the aliases in the order they were given */
+	for (i = naliases - 1; i >= 0; i--) {
+		struct module_alias *a = alloc_module_alias(aliases[i], m);
+
+		if (!a)
+			continue;
+		a->next = m->aliases;
+		m->aliases = a;
+	}
 
 	return m;
 }
 
 static void free_module(struct module *m)
 {
+	struct module_alias *a, *next;
+
+	for (a = m->aliases; a; a = next) {
+		next = a->next;
+		free(a);
+	}
 	if (m->opts)
 		free(m->opts);
+	free(m->deps);
+	free(m->dependents);
 	free(m);
 }
 
+/*
+ * Resolve the depends list of a module to module pointers. This is redone
+ * only after new modules were added, as one of them may be a dependency
+ * that was missing before.
+ */
+static int resolve_moddeps(struct module *m)
+{
+	char *dep;
+	int n = 0;
+
+	if (m->deps_gen == module_gen)
+		return m->ndeps;
+
+	if (m->depends && strcmp(m->depends, "-"))
+		for (dep = m->depends; *dep; dep += strlen(dep) + 1)
+			n++;
+
+	if (n && !m->deps) {
+		m->deps = calloc(n, sizeof(*m->deps));
+		if (!m->deps)
+			return -1;
+	}
+
+	m->ndeps = n;
+	for (n = 0, dep = m->depends; n < m->ndeps; n++, dep += strlen(dep) + 1)
+		m->deps[n] = find_module(dep);
+	m->deps_gen = module_gen;
+
+	return m->ndeps;
+}
+
 static int scan_loaded_modules(void)
 {
 	size_t buf_len = 0;
@@ -324,7 +569,7 @@ static int scan_loaded_modules(void)
 
 static struct module* get_module_info(const char *module, const char *name)
 {
-	int fd = open(module, O_RDONLY);
+	int fd = open_module(module);
 	unsigned int offset, size;
 	char *map = MAP_FAILED, *strings, *dep = NULL;
 	const char *aliases[32];
@@ -394,7 +639,7 @@ out:
 	return m;
 }
 
-static int scan_module_folder(const char *dir)
+static int scan_module_files(const char *dir)
 {
 	int gl_flags = GLOB_NOESCAPE | GLOB_MARK;
 	struct utsname ver;
@@ -403,22 +648,33 @@ static int scan_module_folder(const char *dir)
 	int j;
 
 	uname(&ver);
-	path = alloca(strlen(dir) + sizeof("*.ko") + 1);
-	sprintf(path, "%s*.ko", dir);
+	path = alloca(strlen(dir) + sizeof("*.ko*") + 1);
+	sprintf(path, "%s*.ko*", dir);
 
 	if (glob(path, gl_flags, NULL, &gl) < 0)
 		return -1;
 
 	for (j = 0; j < gl.gl_pathc; j++) {
-		char *name = get_module_name(gl.gl_pathv[j]);
+		char *name;
 		struct module *m;
 
+		if (get_module_ext(gl.gl_pathv[j]) < 0)
+			continue;
+
+		name = get_module_name(gl.gl_pathv[j]);
 		if (!name)
 			continue;
 
 		m = find_module(name);
-		if (!m)
-			get_module_info(gl.gl_pathv[j], name);
+		if (!m) {
+			uint64_t t = profile_time();
+
+			m = get_module_info(gl.gl_pathv[j], name);
+			if (m) {
+				m->t_scan = t;
+				m->t_scan_end = profile_time();
+			}
+		}
 	}
 
 	globfree(&gl);
@@ -426,6 +682,170 @@ static int scan_module_folder(const char *dir)
 	return 0;
 }
 
+static int load_module_index(const char *dir)
+{
+	struct module_index_entry *e;
+	struct module_index *idx;
+	const char *aliases[32];
+	char path[256], *strings, *alias;
+	struct stat ds, s;
+	struct module *m;
+	int fd, i, j, ret = -1;
+
+	snprintf(path, sizeof(path), "%s" MOD_INDEX, dir);
+	if (stat(dir, &ds))
+		return -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &s) || (s.st_size < sizeof(*idx))) {
+		close(fd);
+		return -1;
+	}
+
+	idx = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (idx == MAP_FAILED)
+		return -1;
+
+	if ((idx->magic != MOD_INDEX_MAGIC) || (idx->version != MOD_INDEX_VERSION) ||
+	    (idx->count > s.st_size / sizeof(*e)) ||
+	    (sizeof(*idx) + idx->count * sizeof(*e) + idx->strings != s.st_size) ||
+	    !idx->strings) {
+		ULOG_WARN("ignoring invalid module index %s\n", path);
+		goto out;
+	}
+
+	if ((idx->dir_ino != ds.st_ino) || (idx->dir_mtime != ds.st_mtim.tv_sec) ||
+	    (idx->dir_mtime_nsec != ds.st_mtim.tv_nsec)) {
+		ULOG_INFO("module index %s is stale\n", path);
+		goto out;
+	}
+
+	e = (struct module_index_entry *) &idx[1];
+	strings = (char *) &e[idx->count];
+	if (strings[idx->strings - 1])
+		goto out;
+
+	for (i = 0; i < idx->count; i++, e++) {
+		if ((e->name >= idx->strings) || (e->aliases > idx->strings) ||
+		    ((e->depends != UINT32_MAX) && (e->depends >= idx->strings)) ||
+		    (e->naliases > ARRAY_SIZE(aliases)))
+			goto out;
+
+		if (find_module(strings + e->name))
+			continue;
+
+		for (j = 0, alias = strings + e->aliases; j < e->naliases; j++) {
+			if (alias >= strings + idx->strings)
+				goto out;
+			aliases[j] = alias;
+			alias += strlen(alias) + 1;
+		}
+
+		m = alloc_module(strings + e->name, aliases, e->naliases,
+			(e->depends != UINT32_MAX) ? (strings + e->depends) : (NULL), e->size);
+		if (m)
+			m->state = SCANNED;
+	}
+	ret = 0;
+
+out:
+	munmap(idx, s.st_size);
+
+	return ret;
+}
+
+static int scan_module_folder(const char *dir)
+{
+	if (!load_module_index(dir))
+		return 0;
+
+	return scan_module_files(dir);
+}
+
+static int write_module_index(const char *dir)
+{
+	struct module_index idx = { .magic = MOD_INDEX_MAGIC, .version = MOD_INDEX_VERSION };
+	struct module_index_entry *entries, *e;
+	struct module_alias *a;
+	char path[256], tmp[256];
+	char *strings = NULL;
+	size_t len = 0;
+	struct stat ds;
+	struct module *m;
+	FILE *fp;
+	char *dep;
+	int fd, ret = -1;
+
+	entries = calloc(nmodules + 1, sizeof(*entries));
+	fp = open_memstream(&strings, &len);
+	if (!entries || !fp)
+		goto out;
+
+	e = entries;
+	list_for_each_entry(m, &modules, list) {
+		e->name = ftell(fp);
+		fwrite(m->name, strlen(m->name) + 1, 1, fp);
+
+		e->depends = UINT32_MAX;
+		if (m->depends) {
+			e->depends = ftell(fp);
+			for (dep = m->depends; *dep; dep += strlen(dep) + 1)
+				fprintf(fp, "%s%s", (dep == m->depends) ? ("") : (","), dep);
+			fputc('\0', fp);
+		}
+
+		e->aliases = ftell(fp);
+		for (a = m->aliases; a; a = a->next) {
+			fwrite(a->name, strlen(a->name) + 1, 1, fp);
+			e->naliases++;
+		}
+		e->size = m->size;
+		e++;
+		idx.count++;
+	}
+	if (fclose(fp))
+		goto out;
+	fp = NULL;
+	idx.strings = len;
+
+	snprintf(path, sizeof(path), "%s" MOD_INDEX, dir);
+	snprintf(tmp, sizeof(tmp), "%s" MOD_INDEX ".tmp", dir);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ULOG_ERR("failed to create %s\n", tmp);
+		goto out;
+	}
+
+	if ((write(fd, &idx, sizeof(idx)) != sizeof(idx)) ||
+	    (write(fd, entries, idx.count * sizeof(*entries)) != idx.count * sizeof(*entries)) ||
+	    (write(fd, strings, len) != len) || rename(tmp, path) || stat(dir, &ds)) {
+		ULOG_ERR("failed to write %s\n", path);
+		unlink(tmp);
+		close(fd);
+		goto out;
+	}
+
+	/* installing the index changed the folder, record it afterwards */
+	idx.dir_ino = ds.st_ino;
+	idx.dir_mtime = ds.st_mtim.tv_sec;
+	idx.dir_mtime_nsec = ds.st_mtim.tv_nsec;
+	if ((pwrite(fd, &idx, sizeof(idx), 0) == sizeof(idx)) && !fsync(fd))
+		ret = 0;
+	close(fd);
+
+out:
+	if (fp)
+		fclose(fp);
+	free(strings);
+	free(entries);
+
+	return ret;
+}
+
 static int scan_module_folders(void)
 {
 	int rv = 0;
@@ -442,7 +862,7 @@ static int scan_module_folders(void)
 
 static int print_modinfo(char *module)
 {
-	int fd = open(module, O_RDONLY);
+	int fd = open_module(module);
 	unsigned int offset, size;
 	struct stat s;
 	char *map = MAP_FAILED, *strings;
@@ -509,123 +929,282 @@ out:
 
 static int deps_available(struct module *m, int verbose)
 {
+	struct module *d;
 	char *dep;
-	int err = 0;
-
-	if (!m->depends || !strcmp(m->depends, "-") || !strcmp(m->depends, ""))
-		return 0;
+	int i, err = 0;
 
-	dep = m->depends;
+	if (resolve_moddeps(m) < 0)
+		return -1;
 
-	while (*dep) {
-		m = find_module(dep);
+	for (i = 0, dep = m->depends; i < m->ndeps; i++, dep += strlen(dep) + 1) {
+		d = m->deps[i];
 
-		if (verbose && !m)
+		if (verbose && !d)
 			ULOG_ERR("missing dependency %s\n", dep);
-		if (verbose && m && (m->state != LOADED))
+		if (verbose && d && (d->state != LOADED))
 			ULOG_ERR("dependency not loaded %s\n", dep);
-		if (!m || (m->state != LOADED))
+		if (!d || (d->state != LOADED))
 			err++;
-		dep += strlen(dep) + 1;
 	}
 
 	return err;
 }
 
-static int insert_module(char *path, const char *options)
+/* kernels without finit_module() need the module image in memory */
+static int init_module_map(int fd, const char *path, const char *options)
 {
-	void *data = 0;
 	struct stat s;
-	int fd, ret = -1;
+	void *map;
+	int ret;
 
-	if (stat(path, &s)) {
-		ULOG_ERR("missing module %s\n", path);
-		return ret;
+	if (fstat(fd, &s)) {
+		ULOG_ERR("failed to stat %s\n", path);
+		return -1;
 	}
 
-	fd = open(path, O_RDONLY);
+	map = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		ULOG_ERR("failed to mmap %s\n", path);
+		return -1;
+	}
+
+	ret = syscall(__NR_init_module, map, (unsigned long) s.st_size, options);
+	munmap(map, s.st_size);
+
+	return ret;
+}
+
+static int insert_module(char *path, const char *options)
+{
+	int fd, tmp, ret = -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
 	if (fd < 0) {
 		ULOG_ERR("cannot open %s\n", path);
 		return ret;
 	}
 
-	data = malloc(s.st_size);
-	if (read(fd, data, s.st_size) == s.st_size) {
-		ret = syscall(__NR_init_module, data, (unsigned long) s.st_size, options);
-		if (errno == EEXIST)
-			ret = 0;
+	if (get_module_ext(path) > 0) {
+		/* let the kernel decompress the module if it knows how to */
+		ret = syscall(__NR_finit_module, fd, options, MODULE_INIT_COMPRESSED_FILE);
+		if (ret && ((errno == EINVAL) || (errno == EOPNOTSUPP) || (errno == ENOSYS))) {
+			tmp = decompress_module(path, fd);
+			close(fd);
+			fd = tmp;
+			if (fd < 0)
+				return -1;
+		} else {
+			goto out;
+		}
 	}
-	else
-		ULOG_ERR("failed to read full module %s\n", path);
+
+	ret = syscall(__NR_finit_module, fd, options, 0);
+	if (ret && (errno == ENOSYS))
+		ret = init_module_map(fd, path, options);
+
+out:
+	if (ret && (errno == EEXIST))
+		ret = 0;
 
 	close(fd);
-	free(data);
 
 	return ret;
 }
 
 static void load_moddeps(struct module *_m)
 {
-	char *dep;
 	struct module *m;
+	char *dep;
+	int i;
 
-	if (!strcmp(_m->depends, "-") || !strcmp(_m->depends, ""))
+	if (resolve_moddeps(_m) < 0)
 		return;
 
-	dep = _m->depends;
-
-	while (*dep) {
-		m = find_module(dep);
+	for (i = 0, dep = _m->depends; i < _m->ndeps; i++, dep += strlen(dep) + 1) {
+		m = _m->deps[i];
 
 		if (!m)
 			ULOG_ERR("failed to find dependency %s\n", dep);
-		if (m && (m->state != LOADED)) {
+		/* modules already in PROBE are being expanded, skip them to stop at cycles */
+		if (m && (m->state != LOADED) && (m->state != PROBE)) {
 			m->state = PROBE;
 			load_moddeps(m);
 		}
+	}
+}
 
-		dep = dep + strlen(dep) + 1;
+static int add_dependent(struct module *m, struct module *dependent)
+{
+	struct module **d;
+
+	if (m->ndependents == m->maxdependents) {
+		d = realloc(m->dependents, sizeof(*d) * (m->maxdependents + 8));
+		if (!d)
+			return -1;
+		m->dependents = d;
+		m->maxdependents += 8;
 	}
+	m->dependents[m->ndependents++] = dependent;
+
+	return 0;
+}
+
+/*
+ * Link every module that is to be loaded to the modules it depends on and
+ * return the number of modules that can be inserted right away.
+ */
+static int build_moddeps(struct module **ready)
+{
+	struct module *m, *d;
+	int i, n = 0;
+
+	list_for_each_entry(m, &modules, list)
+		m->ndependents = 0;
+
+	list_for_each_entry(m, &modules, list) {
+		if (m->state != PROBE)
+			continue;
+
+		if (resolve_moddeps(m) < 0)
+			return -1;
+
+		m->pending = 0;
+		for (i = 0; i < m->ndeps; i++) {
+			d = m->deps[i];
+			if (d && (d->state == LOADED))
+				continue;
+			/* a missing dependency keeps the module pending forever */
+			m->pending++;
+			if (d && (d->state == PROBE) && add_dependent(d, m))
+				return -1;
+		}
+
+		if (!m->pending) {
+			m->t_ready = profile_time();
+			ready[n++] = m;
+		}
+	}
+
+	return n;
+}
+
+static int get_workers(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (n > 1) ? (n) : (1);
+}
+
+static pid_t start_worker(struct module *m)
+{
+	pid_t pid;
+
+	m->t_start = profile_time();
+	pid = fork();
+
+	if (pid)
+		return pid;
+
+	_exit(insert_module(get_module_path(m->name), (m->opts) ? (m->opts) : ("")) ? 1 : 0);
 }
 
 static int iterations = 0;
+
+/*
+ * Insert all modules in state PROBE, each one once all of its dependencies
+ * are loaded, running up to get_workers() insertions concurrently. A
+ * module that fails only holds back the modules depending on it. Failed
+ * modules are retried as long as a round still loads something.
+ */
 static int load_modprobe(void)
 {
-	int loaded, todo;
-	struct module_node *mn;
-	struct module *m;
+	struct module **ready, **running, *m;
+	int nready, nrunning, workers = get_workers();
+	int loaded, todo, status, i;
+	pid_t pid;
+
+	ready = calloc(nmodules + 1, sizeof(*ready));
+	running = calloc(workers, sizeof(*running));
+	if (!ready || !running) {
+		free(ready);
+		free(running);
+		return -1;
+	}
 
-	avl_for_each_element(&modules, mn, avl) {
-		if (mn->is_alias)
-			continue;
-		m = mn->m;
+	list_for_each_entry(m, &modules, list) {
 		if (m->state == PROBE)
 			load_moddeps(m);
 	}
 
 	do {
 		loaded = 0;
-		todo = 0;
-		avl_for_each_element(&modules, mn, avl) {
-			if (mn->is_alias)
-				continue;
-			m = mn->m;
-			if ((m->state == PROBE) && (!deps_available(m, 0))) {
-				if (!insert_module(get_module_path(m->name), (m->opts) ? (m->opts) : (""))) {
-					m->state = LOADED;
-					m->error = 0;
-					loaded++;
+		nrunning = 0;
+		nready = build_moddeps(ready);
+		if (nready < 0)
+			break;
+
+		while (nready || nrunning) {
+			while (nready && (nrunning < workers)) {
+				m = ready[--nready];
+				m->pid = start_worker(m);
+				if (m->pid < 0) {
+					m->error = 1;
 					continue;
 				}
+				for (i = 0; running[i]; i++)
+					;
+				m->worker = i;
+				running[i] = m;
+				nrunning++;
+			}
+
+			if (!nrunning)
+				break;
+
+			pid = waitpid(-1, &status, 0);
+			if (pid < 0) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+
+			for (i = 0; (i < workers) && (!running[i] || (running[i]->pid != pid)); i++)
+				;
+			if (i == workers)
+				continue;
+			m = running[i];
+			running[i] = NULL;
+			nrunning--;
+			m->t_done = profile_time();
+			m->pass = iterations + 1;
+
+			if (!WIFEXITED(status) || WEXITSTATUS(status)) {
 				m->error = 1;
+				continue;
 			}
 
-			if ((m->state == PROBE) || m->error)
-				todo++;
+			m->state = LOADED;
+			m->error = 0;
+			loaded++;
+			for (i = 0; i < m->ndependents; i++) {
+				if (--m->dependents[i]->pending)
+					continue;
+				m->dependents[i]->t_ready = m->t_done;
+				ready[nready++] = m->dependents[i];
+			}
 		}
 		iterations++;
 	} while (loaded);
 
+	todo = 0;
+	list_for_each_entry(m, &modules, list) {
+		if ((m->state == PROBE) || m->error)
+			todo++;
+	}
+
+	free(ready);
+	free(running);
+
 	return todo;
 }
 
@@ -740,17 +1319,13 @@ static int main_rmmod(int argc, char **argv)
 
 static int main_lsmod(int argc, char **argv)
 {
-	struct module_node *mn;
 	struct module *m;
 	char *dep;
 
 	if (scan_loaded_modules())
 		return -1;
 
-	avl_for_each_element(&modules, mn, avl) {
-		if (mn->is_alias)
-			continue;
-		m = mn->m;
+	list_for_each_entry(m, &modules, list) {
 		if (m->state == LOADED) {
 			printf("%-20s%8d%3d ",
 				m->name, m->size, m->usage);
@@ -803,7 +1378,6 @@ static int main_modinfo(int argc, char **argv)
 
 static int main_modprobe(int argc, char **argv)
 {
-	struct module_node *mn;
 	struct module *m;
 	char *name;
 	char *mod = NULL;
@@ -853,10 +1427,7 @@ static int main_modprobe(int argc, char **argv)
 			ULOG_ERR("%d module%s could not be probed\n",
 			         fail, (fail == 1) ? ("") : ("s"));
 
-			avl_for_each_element(&modules, mn, avl) {
-				if (mn->is_alias)
-					continue;
-				m = mn->m;
+			list_for_each_entry(m, &modules, list) {
 				if ((m->state == PROBE) || m->error)
 					ULOG_ERR("- %s\n", m->name);
 			}
@@ -868,27 +1439,131 @@ static int main_modprobe(int argc, char **argv)
 	return 0;
 }
 
+static int main_index(int argc, char **argv)
+{
+	int ret = 0;
+	char **p;
+
+	if (init_module_folders()) {
+		ULOG_ERR("failed to find the folder holding the modules\n");
+		return -1;
+	}
+
+	for (p = module_folders; *p; p++) {
+		if (scan_module_files(*p) || write_module_index(*p)) {
+			ULOG_ERR("failed to index %s\n", *p);
+			ret = -1;
+		} else {
+			ULOG_INFO("indexed %s\n", *p);
+		}
+		free_modules();
+	}
+
+	return ret;
+}
+
+static int profile_cmp(const void *k1, const void *k2)
+{
+	const struct module *m1 = *(const struct module **) k1;
+	const struct module *m2 = *(const struct module **) k2;
+	uint64_t d1 = m1->t_done - m1->t_start;
+	uint64_t d2 = m2->t_done - m2->t_start;
+
+	return (d1 < d2) - (d1 > d2);
+}
+
+/*
+ * Log the modules that took longest to insert and, unless file is "-",
+ * write a Chrome trace (chrome://tracing, Perfetto) of the whole run with
+ * one row per worker.
+ */
+static void write_profile(const char *file, uint64_t scan)
+{
+	uint64_t end = profile_time();
+	struct module **sorted, *m;
+	int i, n = 0;
+	FILE *fp;
+
+	sorted = calloc(nmodules + 1, sizeof(*sorted));
+	if (!sorted)
+		return;
+
+	list_for_each_entry(m, &modules, list)
+		if (m->pass)
+			sorted[n++] = m;
+	qsort(sorted, n, sizeof(*sorted), profile_cmp);
+
+	ULOG_INFO("profile: scan %" PRIu64 "us, %d modules tried in %d passes, %" PRIu64 "us total\n",
+		scan, n, iterations, end);
+	for (i = 0; (i < n) && (i < 10); i++)
+		ULOG_INFO("profile: %s insert %" PRIu64 "us, queued %" PRIu64 "us, pass %d%s\n",
+			sorted[i]->name, sorted[i]->t_done - sorted[i]->t_start,
+			sorted[i]->t_start - sorted[i]->t_ready, sorted[i]->pass,
+			(sorted[i]->error) ? (", failed") : (""));
+	free(sorted);
+
+	if (!strcmp(file, "-"))
+		return;
+
+	fp = fopen(file, "w");
+	if (!fp) {
+		ULOG_ERR("failed to open %s\n", file);
+		return;
+	}
+
+	fprintf(fp, "{\"traceEvents\":[\n");
+	fprintf(fp, "{\"name\":\"scan\",\"cat\":\"scan\",\"ph\":\"X\",\"ts\":0,\"dur\":%" PRIu64 ",\"pid\":1,\"tid\":0}", scan);
+	list_for_each_entry(m, &modules, list) {
+		if (m->t_scan_end)
+			fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"scan\",\"ph\":\"X\",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"pid\":1,\"tid\":0}",
+				m->name, m->t_scan, m->t_scan_end - m->t_scan);
+		if (m->pass)
+			fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"insert\",\"ph\":\"X\",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"pid\":1,\"tid\":%d,"
+				"\"args\":{\"queued\":%" PRIu64 ",\"pass\":%d,\"failed\":%s}}",
+				m->name, m->t_start, m->t_done - m->t_start, m->worker + 1,
+				m->t_start - m->t_ready, m->pass, (m->error) ? ("true") : ("false"));
+	}
+	fprintf(fp, "\n]}\n");
+
+	if (fclose(fp))
+		ULOG_ERR("failed to write %s\n", file);
+}
+
 static int main_loader(int argc, char **argv)
 {
 	int gl_flags = GLOB_NOESCAPE | GLOB_MARK;
 	char *dir = "/etc/modules.d/";
-	struct module_node *mn;
+	char *profile = NULL;
 	struct module *m;
+	uint64_t scan;
 	glob_t gl;
 	char *path;
-	int fail, j;
+	int fail, j, opt;
+
+	while ((opt = getopt(argc, argv, "p:")) != -1) {
+		switch (opt) {
+		case 'p':
+			profile = optarg;
+			break;
+		default:
+			ULOG_INFO("Usage:\n\tkmodloader [-p <trace file>|-] [dir]\n");
+			return -1;
+		}
+	}
 
-	if (argc > 1)
-		dir = argv[1];
+	if (optind < argc)
+		dir = argv[optind];
 
 	path = malloc(strlen(dir) + 2);
 	strcpy(path, dir);
 	strcat(path, "*");
 
+	profile_start = profile_time();
 	if (scan_module_folders()) {
 		free (path);
 		return -1;
 	}
+	scan = profile_time();
 
 	if (scan_loaded_modules()) {
 		free (path);
@@ -943,10 +1618,7 @@ static int main_loader(int argc, char **argv)
 		ULOG_ERR("%d module%s could not be probed\n",
 		         fail, (fail == 1) ? ("") : ("s"));
 
-		avl_for_each_element(&modules, mn, avl) {
-			if (mn->is_alias)
-				continue;
-			m = mn->m;
+		list_for_each_entry(m, &modules, list) {
 			if ((m->state == PROBE) || (m->error))
 				ULOG_ERR("- %s - %d\n", m->name, deps_available(m, 1));
 		}
@@ -954,6 +1626,9 @@ static int main_loader(int argc, char **argv)
 		ULOG_INFO("done loading kernel modules from %s\n", path);
 	}
 
+	if (profile)
+		write_profile(profile, scan);
+
 out:
 	globfree(&gl);
 	free(path);
@@ -961,30 +1636,10 @@ out:
 	return 0;
 }
 
-static inline char weight(char c)
-{
-	return c == '_' ? '-' : c;
-}
-
-static int avl_modcmp(const void *k1, const void *k2, void *ptr)
-{
-	const char *s1 = k1;
-	const char *s2 = k2;
-
-	while (*s1 && (weight(*s1) == weight(*s2)))
-	{
-		s1++;
-		s2++;
-	}
-
-	return (unsigned char)weight(*s1) - (unsigned char)weight(*s2);
-}
-
 int main(int argc, char **argv)
 {
 	char *exec = basename(*argv);
 
-	avl_init(&modules, avl_modcmp, false, NULL);
 	if (!strcmp(exec, "insmod"))
 		return main_insmod(argc, argv);
 
@@ -1000,6 +1655,9 @@ int main(int argc, char **argv)
 	if (!strcmp(exec, "modprobe"))
 		return main_modprobe(argc, argv);
 
+	if ((argc > 1) && !strcmp(argv[1], "index"))
+		return main_index(argc, argv);
+
 	ulog_open(ULOG_KMSG, LOG_USER, "kmodloader");
 	return main_loader(argc, argv);
 }
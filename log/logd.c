@@ -12,9 +12,11 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <sys/resource.h>
 
 #include <linux/types.h>
 
@@ -26,6 +28,9 @@
 
 #include "syslog.h"
 
+/* stop queueing live messages for a reader that has this much pending */
+#define CLIENT_MAX_BACKLOG	(256 * 1024)
+
 int debug = 0;
 static struct blob_buf b;
 static struct ubus_auto_conn conn;
@@ -34,24 +39,117 @@ static LIST_HEAD(clients);
 enum {
 	READ_LINES,
 	READ_STREAM,
+	READ_SINCE_ID,
+	READ_PRIORITY,
+	READ_SOURCE,
+	READ_MATCH,
+	READ_REGEX,
+	READ_SINCE,
+	READ_UNTIL,
+	READ_TAG,
 	__READ_MAX
 };
 
 static const struct blobmsg_policy read_policy[__READ_MAX] = {
 	[READ_LINES] = { .name = "lines", .type = BLOBMSG_TYPE_INT32 },
 	[READ_STREAM] = { .name = "stream", .type = BLOBMSG_TYPE_BOOL },
+	[READ_SINCE_ID] = { .name = "since_id", .type = BLOBMSG_TYPE_INT32 },
+	[READ_PRIORITY] = { .name = "priority_max", .type = BLOBMSG_TYPE_INT32 },
+	[READ_SOURCE] = { .name = "source", .type = BLOBMSG_TYPE_INT32 },
+	[READ_MATCH] = { .name = "match", .type = BLOBMSG_TYPE_STRING },
+	[READ_REGEX] = { .name = "regex", .type = BLOBMSG_TYPE_BOOL },
+	[READ_SINCE] = { .name = "since", .type = BLOBMSG_TYPE_INT64 },
+	[READ_UNTIL] = { .name = "until", .type = BLOBMSG_TYPE_INT64 },
+	[READ_TAG] = { .name = "tag", .type = BLOBMSG_TYPE_STRING },
 };
 
 static const struct blobmsg_policy write_policy =
 	{ .name = "event", .type = BLOBMSG_TYPE_STRING };
 
+static const struct blobmsg_policy resize_policy =
+	{ .name = "size", .type = BLOBMSG_TYPE_INT32 };
+
+enum {
+	LIMIT_RATE,
+	LIMIT_BURST,
+	LIMIT_DEDUP,
+	__LIMIT_MAX
+};
+
+static const struct blobmsg_policy limit_policy[__LIMIT_MAX] = {
+	[LIMIT_RATE] = { .name = "rate", .type = BLOBMSG_TYPE_INT32 },
+	[LIMIT_BURST] = { .name = "burst", .type = BLOBMSG_TYPE_INT32 },
+	[LIMIT_DEDUP] = { .name = "dedup", .type = BLOBMSG_TYPE_BOOL },
+};
+
 struct client {
 	struct list_head list;
 
 	struct ustream_fd s;
 	int fd;
+	unsigned int dropped;
+	unsigned int max_pending;
+	struct log_filter filter;
 };
 
+static void
+filter_free(struct log_filter *f)
+{
+	if (f->match && f->regex)
+		regfree(&f->pattern);
+	free(f->match);
+	free(f->tag);
+}
+
+static int
+filter_parse(struct log_filter *f, struct blob_attr **tb)
+{
+	memset(f, 0, sizeof(*f));
+	f->priority = -1;
+	f->source = SOURCE_ANY;
+
+	if (tb[READ_SINCE_ID]) {
+		/* no id follows the last one, and first_id would wrap to 0 */
+		if (blobmsg_get_u32(tb[READ_SINCE_ID]) == UINT32_MAX)
+			return UBUS_STATUS_INVALID_ARGUMENT;
+		f->first_id = blobmsg_get_u32(tb[READ_SINCE_ID]) + 1;
+	}
+	if (tb[READ_PRIORITY])
+		f->priority = blobmsg_get_u32(tb[READ_PRIORITY]);
+	if (tb[READ_SOURCE])
+		f->source = blobmsg_get_u32(tb[READ_SOURCE]);
+	if (tb[READ_SINCE])
+		f->since = blobmsg_get_u64(tb[READ_SINCE]);
+	if (tb[READ_UNTIL])
+		f->until = blobmsg_get_u64(tb[READ_UNTIL]);
+	if (tb[READ_REGEX])
+		f->regex = blobmsg_get_bool(tb[READ_REGEX]);
+	if (tb[READ_TAG]) {
+		f->tag = strdup(blobmsg_get_string(tb[READ_TAG]));
+		if (!f->tag)
+			return UBUS_STATUS_UNKNOWN_ERROR;
+		f->tag_len = strlen(f->tag);
+		f->tag_id = log_tag_intern(f->tag, f->tag_len, false);
+	}
+	if (!tb[READ_MATCH])
+		return 0;
+
+	f->match = strdup(blobmsg_get_string(tb[READ_MATCH]));
+	if (!f->match) {
+		filter_free(f);
+		return UBUS_STATUS_UNKNOWN_ERROR;
+	}
+
+	/* same flavour as logread -e used to compile locally */
+	if (f->regex && regcomp(&f->pattern, f->match, REG_NOSUB)) {
+		f->regex = false;
+		filter_free(f);
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+
+	return 0;
+}
+
 static void
 client_close(struct ustream *s)
 {
@@ -60,6 +158,7 @@ client_close(struct ustream *s)
 	list_del(&cl->list);
 	ustream_free(s);
 	close(cl->fd);
+	filter_free(&cl->filter);
 	free(cl);
 }
 
@@ -76,6 +175,15 @@ log_fill_msg(struct blob_buf *b, struct log_head *l)
 	blobmsg_add_u32(b, "priority", l->priority);
 	blobmsg_add_u32(b, "source", l->source);
 	blobmsg_add_u64(b, "time", (((__u64) l->ts.tv_sec) * 1000) + (l->ts.tv_nsec / 1000000));
+	if (l->tag_len) {
+		char *tag = blobmsg_alloc_string_buffer(b, "tag", l->tag_len + 1);
+
+		memcpy(tag, l->data, l->tag_len);
+		tag[l->tag_len] = '\0';
+		blobmsg_add_string_buffer(b);
+	}
+	if (l->pid)
+		blobmsg_add_u32(b, "pid", l->pid);
 }
 
 static int
@@ -85,6 +193,7 @@ read_log(struct ubus_context *ctx, struct ubus_object *obj,
 {
 	struct client *cl;
 	struct blob_attr *tb[__READ_MAX] = { 0 };
+	struct log_filter filter;
 	struct log_head *l;
 	int count = 0;
 	int fds[2];
@@ -103,23 +212,29 @@ read_log(struct ubus_context *ctx, struct ubus_object *obj,
 			stream = blobmsg_get_bool(tb[READ_STREAM]);
 	}
 
-	if (pipe(fds) == -1) {
-		fprintf(stderr, "logd: failed to create pipe: %s\n", strerror(errno));
-		return -1;
-	}
+	ret = filter_parse(&filter, tb);
+	if (ret)
+		return ret;
 
-	l = log_list(count, NULL);
 	if (stream) {
+		if (pipe(fds) == -1) {
+			fprintf(stderr, "logd: failed to create pipe: %s\n", strerror(errno));
+			filter_free(&filter);
+			return -1;
+		}
+
 		ubus_request_set_fd(ctx, req, fds[0]);
 		cl = calloc(1, sizeof(*cl));
 		cl->s.stream.notify_state = client_notify_state;
 		cl->fd = fds[1];
+		cl->filter = filter;
 		ustream_fd_init(&cl->s, cl->fd);
 		list_add(&cl->list, &clients);
+		l = log_list(count, NULL, &cl->filter);
 		while ((!tb[READ_LINES] || count) && l) {
 			blob_buf_init(&b, 0);
 			log_fill_msg(&b, l);
-			l = log_list(count, l);
+			l = log_list(count, l, &cl->filter);
 			ret = ustream_write(&cl->s.stream, (void *) b.head, blob_len(b.head) + sizeof(struct blob_attr), false);
 			if (ret < 0)
 				break;
@@ -127,14 +242,16 @@ read_log(struct ubus_context *ctx, struct ubus_object *obj,
 	} else {
 		blob_buf_init(&b, 0);
 		c = blobmsg_open_array(&b, "log");
+		l = log_list(count, NULL, &filter);
 		while ((!tb[READ_LINES] || count) && l) {
 			e = blobmsg_open_table(&b, NULL);
 			log_fill_msg(&b, l);
 			blobmsg_close_table(&b, e);
-			l = log_list(count, l);
+			l = log_list(count, l, &filter);
 		}
 		blobmsg_close_array(&b, c);
 		ubus_send_reply(ctx, req, b.head);
+		filter_free(&filter);
 	}
 	blob_buf_free(&b);
 	return 0;
@@ -159,9 +276,186 @@ write_log(struct ubus_context *ctx, struct ubus_object *obj,
 	return 0;
 }
 
+static void
+stats_add_counter(const char *name, const struct log_counter *cnt)
+{
+	void *c = blobmsg_open_table(&b, name);
+
+	blobmsg_add_u32(&b, "messages", cnt->messages);
+	blobmsg_add_u64(&b, "bytes", cnt->bytes);
+	blobmsg_close_table(&b, c);
+}
+
+static void
+stats_add_hist(const char *name, const unsigned int *hist)
+{
+	void *c = blobmsg_open_array(&b, name);
+	int i;
+
+	for (i = 0; i < LOG_HIST_BUCKETS; i++)
+		blobmsg_add_u32(&b, NULL, hist[i]);
+	blobmsg_close_array(&b, c);
+}
+
+static uint64_t
+timeval_ms(const struct timeval *tv)
+{
+	return ((uint64_t) tv->tv_sec * 1000) + (tv->tv_usec / 1000);
+}
+
+/* cpu time in ms and memory in KiB of logd itself */
+static void
+stats_add_process(void)
+{
+	unsigned long pages, rss = 0;
+	struct rusage ru;
+	FILE *fp;
+	void *c;
+
+	fp = fopen("/proc/self/statm", "r");
+	if (fp) {
+		if (fscanf(fp, "%lu %lu", &pages, &rss) != 2)
+			rss = 0;
+		fclose(fp);
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	c = blobmsg_open_table(&b, "process");
+	blobmsg_add_u64(&b, "utime", timeval_ms(&ru.ru_utime));
+	blobmsg_add_u64(&b, "stime", timeval_ms(&ru.ru_stime));
+	blobmsg_add_u32(&b, "rss", rss * (sysconf(_SC_PAGESIZE) / 1024));
+	blobmsg_add_u32(&b, "max_rss", ru.ru_maxrss);
+	blobmsg_add_u32(&b, "voluntary_switches", ru.ru_nvcsw);
+	blobmsg_add_u32(&b, "involuntary_switches", ru.ru_nivcsw);
+	blobmsg_close_table(&b, c);
+}
+
+static int
+stats_log(struct ubus_context *ctx, struct ubus_object *obj,
+		struct ubus_request_data *req, const char *method,
+		struct blob_attr *msg)
+{
+	static const char *sources[] = {
+		[SOURCE_KLOG] = "kernel",
+		[SOURCE_SYSLOG] = "syslog",
+		[SOURCE_INTERNAL] = "internal",
+	};
+	unsigned int size, used, messages;
+	struct client *cl;
+	void *c, *e;
+	int i;
+
+	blob_buf_init(&b, 0);
+	blobmsg_add_u32(&b, "dropped", log_stats.dropped);
+	blobmsg_add_u32(&b, "limited", log_stats.limited);
+	blobmsg_add_u32(&b, "repeated", log_stats.repeated);
+	blobmsg_add_u32(&b, "kernel_dropped", log_stats.kernel_dropped);
+
+	log_usage(&size, &used, &messages);
+	c = blobmsg_open_table(&b, "buffer");
+	blobmsg_add_u32(&b, "size", size);
+	blobmsg_add_u32(&b, "used", used);
+	blobmsg_add_u32(&b, "messages", messages);
+	blobmsg_close_table(&b, c);
+
+	c = blobmsg_open_table(&b, "ingest");
+	for (i = 0; i < ARRAY_SIZE(sources); i++)
+		stats_add_counter(sources[i], &log_stats.ingest[i]);
+	blobmsg_close_table(&b, c);
+	stats_add_counter("evicted", &log_stats.evicted);
+
+	/* buckets are <1us, <4us, <16us, ... */
+	stats_add_hist("ingest_time", log_stats.ingest_time);
+	stats_add_hist("filter_time", log_stats.filter_time);
+	stats_add_process();
+
+	c = blobmsg_open_array(&b, "clients");
+	list_for_each_entry(cl, &clients, list) {
+		e = blobmsg_open_table(&b, NULL);
+		blobmsg_add_u32(&b, "pending", ustream_pending_data(&cl->s.stream, true));
+		blobmsg_add_u32(&b, "max_pending", cl->max_pending);
+		blobmsg_add_u32(&b, "dropped", cl->dropped);
+		blobmsg_close_table(&b, e);
+	}
+	blobmsg_close_array(&b, c);
+	ubus_send_reply(ctx, req, b.head);
+	blob_buf_free(&b);
+
+	return 0;
+}
+
+static int
+resize_log(struct ubus_context *ctx, struct ubus_object *obj,
+		struct ubus_request_data *req, const char *method,
+		struct blob_attr *msg)
+{
+	struct blob_attr *tb = NULL;
+	int size;
+
+	if (msg)
+		blobmsg_parse(&resize_policy, 1, &tb, blob_data(msg), blob_len(msg));
+	if (!tb)
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	/* same unit as -S */
+	size = blobmsg_get_u32(tb);
+	if ((size < 1) || (size > 64 * 1024))
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (log_resize(size * 1024))
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	return 0;
+}
+
+static int
+limits_log(struct ubus_context *ctx, struct ubus_object *obj,
+		struct ubus_request_data *req, const char *method,
+		struct blob_attr *msg)
+{
+	struct blob_attr *tb[__LIMIT_MAX] = { 0 };
+
+	if (msg)
+		blobmsg_parse(limit_policy, __LIMIT_MAX, tb, blob_data(msg), blob_len(msg));
+	if (tb[LIMIT_RATE])
+		log_limits.rate = blobmsg_get_u32(tb[LIMIT_RATE]);
+	if (tb[LIMIT_BURST] && blobmsg_get_u32(tb[LIMIT_BURST]))
+		log_limits.burst = blobmsg_get_u32(tb[LIMIT_BURST]);
+	if (tb[LIMIT_DEDUP])
+		log_limits.dedup = blobmsg_get_bool(tb[LIMIT_DEDUP]);
+
+	blob_buf_init(&b, 0);
+	blobmsg_add_u32(&b, "rate", log_limits.rate);
+	blobmsg_add_u32(&b, "burst", log_limits.burst);
+	blobmsg_add_u8(&b, "dedup", log_limits.dedup);
+	ubus_send_reply(ctx, req, b.head);
+	blob_buf_free(&b);
+
+	return 0;
+}
+
+static int
+snapshot_log(struct ubus_context *ctx, struct ubus_object *obj,
+		struct ubus_request_data *req, const char *method,
+		struct blob_attr *msg)
+{
+	int fd = log_snapshot();
+
+	if (fd < 0)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	ubus_request_set_fd(ctx, req, fd);
+
+	return 0;
+}
+
 static const struct ubus_method log_methods[] = {
 	UBUS_METHOD("read", read_log, read_policy),
 	{ .name = "write", .handler = write_log, .policy = &write_policy, .n_policy = 1 },
+	UBUS_METHOD_NOARG("stats", stats_log),
+	UBUS_METHOD_NOARG("snapshot", snapshot_log),
+	{ .name = "resize", .handler = resize_log, .policy = &resize_policy, .n_policy = 1 },
+	UBUS_METHOD("limits", limits_log, limit_policy),
 };
 
 static struct ubus_object_type log_object_type =
@@ -178,21 +472,28 @@ void
 ubus_notify_log(struct log_head *l)
 {
 	struct client *c;
+	int len = 0, pending;
+
+	list_for_each_entry(c, &clients, list) {
+		if (!log_filter_match(&c->filter, l))
+			continue;
+
+		pending = ustream_pending_data(&c->s.stream, true);
+		if (pending > c->max_pending)
+			c->max_pending = pending;
+		if (pending > CLIENT_MAX_BACKLOG) {
+			c->dropped++;
+			continue;
+		}
 
-	if (list_empty(&clients))
-		return;
-
-	blob_buf_init(&b, 0);
-	blobmsg_add_string(&b, "msg", l->data);
-	blobmsg_add_u32(&b, "id", l->id);
-	blobmsg_add_u32(&b, "priority", l->priority);
-	blobmsg_add_u32(&b, "source", l->source);
-	blobmsg_add_u64(&b, "time", (((__u64) l->ts.tv_sec) * 1000) + (l->ts.tv_nsec / 1000000));
-
-	list_for_each_entry(c, &clients, list)
-		ustream_write(&c->s.stream, (void *) b.head, blob_len(b.head) + sizeof(struct blob_attr), false);
-
-	blob_buf_free(&b);
+		/* encode once, the buffer is kept around for the next message */
+		if (!len) {
+			blob_buf_init(&b, 0);
+			log_fill_msg(&b, l);
+			len = blob_len(b.head) + sizeof(struct blob_attr);
+		}
+		ustream_write(&c->s.stream, (void *) b.head, len, false);
+	}
 }
 
 static void
@@ -212,10 +513,24 @@ int
 main(int argc, char **argv)
 {
 	int ch, log_size = 16;
+	char *store_path = NULL;
 
 	signal(SIGPIPE, SIG_IGN);
-	while ((ch = getopt(argc, argv, "S:")) != -1) {
+	while ((ch = getopt(argc, argv, "S:P:r:b:d")) != -1) {
 		switch (ch) {
+		case 'r':
+			log_limits.rate = atoi(optarg);
+			break;
+		case 'b':
+			if (atoi(optarg) > 0)
+				log_limits.burst = atoi(optarg);
+			break;
+		case 'd':
+			log_limits.dedup = true;
+			break;
+		case 'P':
+			store_path = optarg;
+			break;
 		case 'S':
 			log_size = atoi(optarg);
 			if (log_size < 1)
@@ -226,7 +541,7 @@ main(int argc, char **argv)
 	log_size *= 1024;
 
 	uloop_init();
-	log_init(log_size);
+	log_init(log_size, store_path);
 	conn.cb = ubus_connect_handler;
 	ubus_auto_connect(&conn);
 	uloop_run();
@@ -12,10 +12,16 @@
  * GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <time.h>
 #include <regex.h>
 #include <stdio.h>
@@ -34,6 +40,14 @@
 #include "../rfc3339/timestamp.h"
 #include "syslog.h"
 
+#define LOG_QUEUE_LEN		128
+#define LOG_QUEUE_SLOT		(512 + 16)
+#define LOG_QUEUE_BATCH		4096
+#define LOG_QUEUE_DELAY		50
+
+#define LOG_FILE_BUF		4096
+#define LOG_FILE_SYNC		1000
+
 enum {
 	LOG_STDOUT,
 	LOG_FILE,
@@ -46,6 +60,8 @@ enum {
 	LOG_PRIO,
 	LOG_SOURCE,
 	LOG_TIME,
+	LOG_TAG,
+	LOG_PROCID,
 	__LOG_MAX
 };
 
@@ -55,6 +71,8 @@ static const struct blobmsg_policy log_policy[] = {
 	[LOG_PRIO] = { .name = "priority", .type = BLOBMSG_TYPE_INT32 },
 	[LOG_SOURCE] = { .name = "source", .type = BLOBMSG_TYPE_INT32 },
 	[LOG_TIME] = { .name = "time", .type = BLOBMSG_TYPE_INT64 },
+	[LOG_TAG] = { .name = "tag", .type = BLOBMSG_TYPE_STRING },
+	[LOG_PROCID] = { .name = "pid", .type = BLOBMSG_TYPE_INT32 },
 };
 
 enum {
@@ -63,6 +81,8 @@ enum {
 	TPL_FIELD_SOURCE,
 	TPL_FIELD_TIMESTAMP,
 	TPL_FIELD_RFC3339,
+	TPL_FIELD_TAG,
+	TPL_FIELD_PID,
 };
 
 static const char *TPL_FIELDS[] = {
@@ -71,16 +91,48 @@ static const char *TPL_FIELDS[] = {
 	[TPL_FIELD_SOURCE] = "%source%",
 	[TPL_FIELD_TIMESTAMP] = "%timestamp%",
 	[TPL_FIELD_RFC3339] = "%rfc3339%",
+	[TPL_FIELD_TAG] = "%tag%",
+	[TPL_FIELD_PID] = "%pid%",
+};
+
+struct log_queue_msg {
+	uint32_t id;
+	int len;
+	char data[LOG_QUEUE_SLOT];
 };
 
 static struct uloop_timeout retry;
+static struct uloop_timeout flush_timer;
+static struct uloop_timeout sync_timer;
+static struct uloop_timeout resume_timer;
+static struct uloop_process compress_proc;
 static struct uloop_fd sender;
+static struct ustream_fd log_stream;
+static struct ubus_context *ctx;
+static struct blob_buf b;
+static uint32_t log_object;
 static regex_t regexp_preg;
 static const char *log_file, *log_ip, *log_port, *log_prefix, *pid_file, *hostname, *regexp_pattern;
-static const char *log_template;
+static const char *log_template, *snapshot_out, *snapshot_in;
 static int log_type = LOG_STDOUT;
 static int log_size, log_udp, log_follow, log_trailer_null = 0;
-static int log_timestamp;
+static int log_timestamp, log_rfc5424, log_octet_count, log_lines;
+static int log_generations = 1, log_compress, log_sync_interval, log_sync_bytes;
+static timestamp_t log_since, log_until;
+static uint64_t log_since_ms, log_until_ms;	/* 0 for unbounded */
+
+/* -F output, only written out and synced once per group commit */
+static char file_buf[LOG_FILE_BUF];
+static int file_buf_len, file_unsynced;
+static off_t file_size;
+
+/* messages for the remote server, kept across reconnects */
+static struct log_queue_msg log_queue[LOG_QUEUE_LEN];
+static int queue_head, queue_count, queue_bytes, queue_offset;
+static uint32_t queue_last_id;
+static bool queue_gap;
+
+static void log_request(bool resume);
 
 static const char* getcodetext(int value, CODE *codetable) {
 	CODE *i;
@@ -92,6 +144,288 @@ static const char* getcodetext(int value, CODE *codetable) {
 	return "<unknown>";
 };
 
+static void log_file_open(void)
+{
+	struct stat s;
+
+	sender.fd = open(log_file, O_CREAT | O_WRONLY | O_APPEND, 0600);
+	if (sender.fd < 0) {
+		fprintf(stderr, "failed to open %s: %s\n", log_file, strerror(errno));
+		exit(-1);
+	}
+	file_size = fstat(sender.fd, &s) ? 0 : s.st_size;
+}
+
+static void log_file_write_buf(void)
+{
+	char *p = file_buf;
+	ssize_t ret;
+
+	while (file_buf_len > 0) {
+		ret = write(sender.fd, p, file_buf_len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			fprintf(stderr, "failed to write %s: %s\n", log_file, strerror(errno));
+			break;
+		}
+		p += ret;
+		file_buf_len -= ret;
+	}
+	file_buf_len = 0;
+}
+
+static void log_file_sync(void)
+{
+	uloop_timeout_cancel(&sync_timer);
+	log_file_write_buf();
+	if (file_unsynced)
+		fsync(sender.fd);
+	file_unsynced = 0;
+}
+
+static void log_handle_sync(struct uloop_timeout *timeout)
+{
+	log_file_sync();
+}
+
+static void log_file_name(char *buf, size_t len, int gen)
+{
+	const char *ext = log_compress ? ".gz" : "";
+
+	if (gen)
+		snprintf(buf, len, "%s.old.%d%s", log_file, gen, ext);
+	else
+		snprintf(buf, len, "%s.old%s", log_file, ext);
+}
+
+static void log_handle_compress(struct uloop_process *p, int ret)
+{
+	if (ret)
+		fprintf(stderr, "failed to compress %s.old\n", log_file);
+}
+
+static void log_file_compress(void)
+{
+	char old[PATH_MAX];
+	pid_t pid;
+
+	snprintf(old, sizeof(old), "%s.old", log_file);
+	pid = fork();
+	if (pid < 0)
+		return;
+
+	if (!pid) {
+		execlp("gzip", "gzip", "-f", old, NULL);
+		_exit(1);
+	}
+
+	compress_proc.pid = pid;
+	compress_proc.cb = log_handle_compress;
+	uloop_process_add(&compress_proc);
+}
+
+static void log_file_rotate(void)
+{
+	char from[PATH_MAX], to[PATH_MAX];
+	int i;
+
+	/* gzip still works on the previous <file>.old, rotate once it is done */
+	if (compress_proc.pending)
+		return;
+
+	log_file_sync();
+	close(sender.fd);
+
+	for (i = log_generations - 1; i > 0; i--) {
+		log_file_name(from, sizeof(from), i - 1);
+		log_file_name(to, sizeof(to), i);
+		rename(from, to);
+	}
+	snprintf(to, sizeof(to), "%s.old", log_file);
+	rename(log_file, to);
+
+	log_file_open();
+	if (log_compress)
+		log_file_compress();
+}
+
+static int log_file_write(const char *buf, int len)
+{
+	if (log_size && file_size > log_size)
+		log_file_rotate();
+
+	file_size += len;
+	file_unsynced += len;
+
+	/* no group commit, write and sync every single message */
+	if (!log_sync_interval && !log_sync_bytes) {
+		len = write(sender.fd, buf, len);
+		log_file_sync();
+		return len;
+	}
+
+	if (file_buf_len + len > sizeof(file_buf))
+		log_file_write_buf();
+
+	if (len > sizeof(file_buf)) {
+		len = write(sender.fd, buf, len);
+	} else {
+		memcpy(file_buf + file_buf_len, buf, len);
+		file_buf_len += len;
+	}
+
+	if (log_sync_bytes && file_unsynced >= log_sync_bytes)
+		log_file_sync();
+	else if (!sync_timer.pending)
+		uloop_timeout_set(&sync_timer, log_sync_interval ? log_sync_interval : LOG_FILE_SYNC);
+
+	return len;
+}
+
+static void log_net_close(void)
+{
+	uloop_fd_delete(&sender);
+	close(sender.fd);
+	sender.fd = -1;
+	/* a partially sent head message is resent whole on the new connection */
+	queue_offset = 0;
+	uloop_timeout_set(&retry, 1000);
+}
+
+/* drop fully sent messages from the head of the queue */
+static void log_queue_pop(int count, size_t bytes)
+{
+	struct log_queue_msg *q;
+
+	while (queue_count) {
+		q = &log_queue[queue_head];
+		if (count) {
+			count--;
+		} else if (bytes >= q->len - queue_offset) {
+			bytes -= q->len - queue_offset;
+		} else {
+			queue_offset += bytes;
+			break;
+		}
+
+		queue_bytes -= q->len;
+		queue_offset = 0;
+		queue_head = (queue_head + 1) % LOG_QUEUE_LEN;
+		queue_count--;
+	}
+}
+
+static void log_queue_flush(void)
+{
+	struct mmsghdr msgs[LOG_QUEUE_LEN];
+	struct iovec iov[LOG_QUEUE_LEN];
+	struct log_queue_msg *q;
+	ssize_t ret;
+	int i;
+
+	uloop_timeout_cancel(&flush_timer);
+
+	while (queue_count && sender.fd >= 0) {
+		for (i = 0; i < queue_count; i++) {
+			q = &log_queue[(queue_head + i) % LOG_QUEUE_LEN];
+			iov[i].iov_base = q->data + (i ? 0 : queue_offset);
+			iov[i].iov_len = q->len - (i ? 0 : queue_offset);
+		}
+
+		if (log_udp) {
+			memset(msgs, 0, sizeof(msgs[0]) * queue_count);
+			for (i = 0; i < queue_count; i++) {
+				msgs[i].msg_hdr.msg_iov = &iov[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			ret = sendmmsg(sender.fd, msgs, queue_count, 0);
+			if (ret > 0)
+				log_queue_pop(ret, 0);
+		} else {
+			ret = writev(sender.fd, iov, queue_count);
+			if (ret > 0)
+				log_queue_pop(0, ret);
+		}
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0) {
+			syslog(LOG_INFO, "failed to send log data to %s:%s via %s\n",
+				log_ip, log_port, (log_udp) ? ("udp") : ("tcp"));
+			log_net_close();
+			return;
+		}
+	}
+
+	/*
+	 * pick up whatever got lost while the queue was full from logd, this
+	 * may run from the read callback of log_stream so it is deferred
+	 */
+	if (!queue_count && queue_gap && sender.fd >= 0) {
+		if (log_follow) {
+			uloop_timeout_set(&resume_timer, 0);
+		} else {
+			fprintf(stderr, "messages after id %u were not sent\n", queue_last_id);
+			queue_gap = false;
+		}
+	}
+}
+
+static void log_handle_resume(struct uloop_timeout *timeout)
+{
+	if (!queue_gap)
+		return;
+
+	queue_gap = false;
+	ustream_free(&log_stream.stream);
+	close(log_stream.fd.fd);
+	log_request(true);
+}
+
+static void log_handle_flush(struct uloop_timeout *timeout)
+{
+	log_queue_flush();
+}
+
+static void log_queue_add(uint32_t id, const char *buf, size_t len)
+{
+	struct log_queue_msg *q;
+
+	if (queue_gap)
+		return;
+
+	if (queue_count == LOG_QUEUE_LEN) {
+		queue_gap = true;
+		return;
+	}
+
+	q = &log_queue[(queue_head + queue_count) % LOG_QUEUE_LEN];
+	if (log_udp) {
+		q->len = len;
+		memcpy(q->data, buf, len);
+	} else if (log_octet_count) {
+		q->len = snprintf(q->data, sizeof(q->data), "%zu ", len);
+		memcpy(q->data + q->len, buf, len);
+		q->len += len;
+	} else {
+		memcpy(q->data, buf, len);
+		q->data[len] = log_trailer_null ? '\0' : '\n';
+		q->len = len + 1;
+	}
+	q->id = id;
+
+	queue_count++;
+	queue_bytes += q->len;
+	queue_last_id = id;
+
+	if (queue_bytes >= LOG_QUEUE_BATCH || queue_count == LOG_QUEUE_LEN)
+		log_queue_flush();
+	else if (!flush_timer.pending)
+		uloop_timeout_set(&flush_timer, LOG_QUEUE_DELAY);
+}
+
 static void log_handle_reconnect(struct uloop_timeout *timeout)
 {
 	sender.fd = usock((log_udp) ? (USOCK_UDP) : (USOCK_TCP), log_ip, log_port);
@@ -101,166 +435,234 @@ static void log_handle_reconnect(struct uloop_timeout *timeout)
 	} else {
 		uloop_fd_add(&sender, ULOOP_READ);
 		syslog(LOG_INFO, "Logread connected to %s:%s\n", log_ip, log_port);
+		log_queue_flush();
 	}
 }
 
 static void log_handle_fd(struct uloop_fd *u, unsigned int events)
 {
-	if (u->eof) {
-		uloop_fd_delete(u);
-		close(sender.fd);
-		sender.fd = -1;
-		uloop_timeout_set(&retry, 1000);
+	if (u->eof)
+		log_net_close();
+}
+
+struct tpl_op {
+	int field;		/* TPL_FIELD_* or -1 for literal text */
+	const char *str;
+	int len;
+};
+
+static struct tpl_op *tpl_ops;
+static int tpl_nops;
+static unsigned int tpl_fields;
+
+static void tpl_add(int field, const char *str, int len)
+{
+	tpl_ops[tpl_nops].field = field;
+	tpl_ops[tpl_nops].str = str;
+	tpl_ops[tpl_nops].len = len;
+	tpl_nops++;
+	if (field >= 0)
+		tpl_fields |= (1 << field);
+}
+
+/* split the template into literal and field ops once at startup */
+static int tpl_compile(const char *tpl)
+{
+	const char *p, *lit;
+	int i, n = 1;
+
+	if (strlen(tpl) + 1 > 512) {
+		fprintf(stderr, "size of template is larger than the internal buffer\n");
+		return -1;
 	}
+
+	for (p = tpl; *p; p++)
+		if (*p == '%')
+			n += 2;
+
+	tpl_ops = calloc(n, sizeof(*tpl_ops));
+	if (!tpl_ops)
+		return -1;
+
+	for (p = lit = tpl; *p; ) {
+		for (i = 0; *p == '%' && i < ARRAY_SIZE(TPL_FIELDS); i++)
+			if (!strncmp(p, TPL_FIELDS[i], strlen(TPL_FIELDS[i])))
+				break;
+
+		if (*p != '%' || i == ARRAY_SIZE(TPL_FIELDS)) {
+			p++;
+			continue;
+		}
+
+		if (p > lit)
+			tpl_add(-1, lit, p - lit);
+		tpl_add(i, NULL, 0);
+		p += strlen(TPL_FIELDS[i]);
+		lit = p;
+	}
+
+	if (p > lit)
+		tpl_add(-1, lit, p - lit);
+
+	return 0;
+}
+
+static const char *source_name(int source)
+{
+	switch (source) {
+	case SOURCE_KLOG:
+		return "kernel";
+	case SOURCE_SYSLOG:
+		return "syslog";
+	case SOURCE_INTERNAL:
+		return "internal";
+	default:
+		return "-";
+	}
+}
+
+/*
+ * UTC offset in seconds. Transitions happen at local wall clock times and
+ * historic offsets are not whole minutes, so only reuse the offset for
+ * messages of the same second.
+ */
+static long log_tz_offset(time_t t)
+{
+	static bool cached;
+	static time_t last;
+	static long offset;
+	struct tm tm;
+
+	if (!cached || t != last) {
+		if (!localtime_r(&t, &tm))
+			return 0;
+		offset = tm.tm_gmtoff;
+		last = t;
+		cached = true;
+	}
+
+	return offset;
+}
+
+static size_t log_rfc3339(char *buf, size_t size, uint64_t t_ms)
+{
+	static timestamp_cache_t cache;
+	timestamp_t ts = {
+		.sec = t_ms / 1000,
+		.nsec = (t_ms % 1000) * 1000000,
+	};
+
+	return timestamp_format_cached(&cache, buf, size, &ts, 3);
+}
+
+static int tpl_render(char *buf, size_t size, struct blob_attr **tb, const char *buf_ts)
+{
+	char tmp[sizeof "YYYY-MM-DDThh:mm:ss.xxxZ"];
+	const char *field;
+	size_t len = 0, flen;
+	int i;
+
+	for (i = 0; i < tpl_nops; i++) {
+		field = tpl_ops[i].str;
+		flen = tpl_ops[i].len;
+
+		switch (tpl_ops[i].field) {
+		case TPL_FIELD_MESSAGE:
+			field = blobmsg_get_string(tb[LOG_MSG]);
+			flen = strlen(field);
+			break;
+		case TPL_FIELD_PRIORITY:
+			flen = snprintf(tmp, sizeof(tmp), "%u", blobmsg_get_u32(tb[LOG_PRIO]));
+			field = tmp;
+			break;
+		case TPL_FIELD_SOURCE:
+			field = source_name(blobmsg_get_u32(tb[LOG_SOURCE]));
+			flen = strlen(field);
+			break;
+		case TPL_FIELD_TIMESTAMP:
+			field = buf_ts;
+			flen = strlen(field);
+			break;
+		case TPL_FIELD_RFC3339:
+			flen = log_rfc3339(tmp, sizeof(tmp), blobmsg_get_u64(tb[LOG_TIME]));
+			field = tmp;
+			break;
+		case TPL_FIELD_TAG:
+			field = tb[LOG_TAG] ? blobmsg_get_string(tb[LOG_TAG]) : "";
+			flen = strlen(field);
+			break;
+		case TPL_FIELD_PID:
+			flen = tb[LOG_PROCID] ? snprintf(tmp, sizeof(tmp), "%u", blobmsg_get_u32(tb[LOG_PROCID])) : 0;
+			field = tmp;
+			break;
+		}
+
+		if (len + flen >= size) {
+			fprintf(stderr, "size of log is larger than the internal buffer\n");
+			return -1;
+		}
+		memcpy(buf + len, field, flen);
+		len += flen;
+	}
+	buf[len] = '\0';
+
+	return len;
 }
 
 static int log_notify(struct blob_attr *msg)
 {
 	struct blob_attr *tb[__LOG_MAX];
-	struct stat s;
 	char buf[512];
-	char buf_rfc3339[sizeof "YYYY-MM-DDThh:mm:ss.xxxZ"];
-	char buf_ts[32];
-	char buf_p[11];
+	char buf_ts[32] = "";
+	char buf_c[sizeof "Www Mmm dd hh:mm:ss yyyy"];
 	uint32_t p;
-	char *str;
 	time_t t;
 	uint32_t t_ms = 0;
-	timestamp_t ts = { 0 };
-	char *c, *m;
+	char *c = NULL, *m;
 	int ret = 0;
 
-	if (sender.fd < 0)
+	if (sender.fd < 0 && log_type != LOG_NET)
 		return 0;
 
 	blobmsg_parse(log_policy, ARRAY_SIZE(log_policy), tb, blob_data(msg), blob_len(msg));
 	if (!tb[LOG_ID] || !tb[LOG_PRIO] || !tb[LOG_SOURCE] || !tb[LOG_TIME] || !tb[LOG_MSG])
 		return 1;
 
-	if ((log_type == LOG_FILE) && log_size && (!stat(log_file, &s)) && (s.st_size > log_size)) {
-		char *old = malloc(strlen(log_file) + 5);
-
-		close(sender.fd);
-		if (old) {
-			sprintf(old, "%s.old", log_file);
-			rename(log_file, old);
-			free(old);
-		}
-		sender.fd = open(log_file, O_CREAT | O_WRONLY | O_APPEND, 0600);
-		if (sender.fd < 0) {
-			fprintf(stderr, "failed to open %s: %s\n", log_file, strerror(errno));
-			exit(-1);
-		}
-	}
-
 	m = blobmsg_get_string(tb[LOG_MSG]);
-	if (regexp_pattern &&
-	    regexec(&regexp_preg, m, 0, NULL, 0) == REG_NOMATCH)
-		return 0;
 	t = blobmsg_get_u64(tb[LOG_TIME]) / 1000;
 	t_ms = blobmsg_get_u64(tb[LOG_TIME]) % 1000;
-	ts.sec = (int64_t) t;
-	ts.nsec = t_ms * 1000000;
-	timestamp_format_precision(buf_rfc3339, sizeof buf_rfc3339, &ts, 3);
-	snprintf(buf_ts, sizeof(buf_ts), "[%lu.%03u] ", (unsigned long) t, t_ms);
-	c = ctime(&t);
 	p = blobmsg_get_u32(tb[LOG_PRIO]);
-	c[strlen(c) - 1] = '\0';
-	str = blobmsg_format_json(msg, true);
-	snprintf(buf_p, sizeof buf_p, "%u", p);
+	if (log_timestamp || (tpl_fields & (1 << TPL_FIELD_TIMESTAMP)))
+		snprintf(buf_ts, sizeof(buf_ts), "[%lu.%03u] ", (unsigned long) t, t_ms);
 
 	if (log_template) {
-		size_t len;
-		int tpli = -1;
-
-		if ((len = strlen(log_template) + 1) > sizeof buf) {
-			fprintf(stderr, "size of template is larger than the internal buffer\n");
+		if (tpl_render(buf, sizeof(buf), tb, buf_ts) < 0)
 			return 1;
-		}
-		strncpy(buf, log_template, len);
-
-		char *substr = buf;
-		for (;;) {
-			char *substrnext = NULL;
-			for (unsigned short i = 0; i < sizeof TPL_FIELDS / sizeof (char *); ++i) {
-				char *substrbuf = strstr(substr, TPL_FIELDS[i]);
-				if (!substrbuf || (substrnext && substrbuf > substrnext))
-					continue;
-				substrnext = substrbuf;
-				tpli = i;
-			}
-			if (!substrnext)
-				break;
-
-			substr = substrnext;
-			char *field = NULL;
-			switch (tpli) {
-			case TPL_FIELD_MESSAGE:
-				field = m;
-				break;
-			case TPL_FIELD_PRIORITY:
-				field = buf_p;
-				break;
-			case TPL_FIELD_SOURCE:
-				switch (blobmsg_get_u32(tb[LOG_SOURCE])) {
-				case SOURCE_KLOG:
-					field = "kernel";
-					break;
-				case SOURCE_SYSLOG:
-					field = "syslog";
-					break;
-				case SOURCE_INTERNAL:
-					field = "internal";
-					break;
-				default:
-					field = "-";
-					break;
-				}
-				break;
-			case TPL_FIELD_TIMESTAMP:
-				field = buf_ts;
-				break;
-			case TPL_FIELD_RFC3339:
-				field = buf_rfc3339;
-				break;
-			}
-			if (!field || tpli < 0)
-				continue;
-
-			char buf2[sizeof buf] = {'\0'};
-			short availen = sizeof buf2 - 1;
-
-			availen -= substr - buf;
-			strncat(buf2, buf, substr - buf);
+	} else if (!log_rfc5424 || log_type != LOG_NET) {
+		long off = log_tz_offset(t);
+		/* timestamp_t only has whole minutes, the rest goes into sec */
+		timestamp_t ts = { .sec = t + off % 60, .offset = off / 60 };
 
-			size_t fieldlen = strlen(field);
-			availen -= fieldlen;
-			if (availen < 0) {
-				fprintf(stderr, "size of log is larger than the internal buffer\n");
-				return 1;
-			}
-			strncat(buf2, field, fieldlen);
-
-			size_t fieldkwlen = strlen(TPL_FIELDS[tpli]);
-			len = strlen(substr) - fieldkwlen;
-			availen -= len;
-			if (availen < 0) {
-				fprintf(stderr, "size of log is larger than the internal buffer\n");
-				return 1;
-			}
-			strncat(buf2, substr + fieldkwlen, len);
-
-			strncpy(buf, buf2, sizeof buf2 - availen);
-			substr += fieldlen;
-		}
+		if (!timestamp_format_ctime(buf_c, sizeof(buf_c), &ts))
+			strcpy(buf_c, "??? ??? ?? ??:??:?? ????");
+		c = buf_c;
 	}
 
 	if (log_type == LOG_NET) {
-		int err;
+		if (log_template) {
+			/* already rendered */
+		} else if (log_rfc5424) {
+			char buf_rfc3339[sizeof "YYYY-MM-DDThh:mm:ss.xxxZ"];
+			const char *app = log_prefix;
 
-		if (!log_template) {
+			if (!app)
+				app = (blobmsg_get_u32(tb[LOG_SOURCE]) == SOURCE_KLOG) ? "kernel" : "-";
+			log_rfc3339(buf_rfc3339, sizeof buf_rfc3339, blobmsg_get_u64(tb[LOG_TIME]));
+			snprintf(buf, sizeof(buf), "<%u>1 %s %s %s - - - %s",
+				p, buf_rfc3339, hostname ? hostname : "-", app, m);
+		} else {
 			snprintf(buf, sizeof(buf), "<%u>", p);
-			strncat(buf, c + 4, sizeof buf_p);
+			strncat(buf, c + 4, 16);
 			if (log_timestamp) {
 				strncat(buf, buf_ts, sizeof(buf) - strlen(buf) - 1);
 			}
@@ -276,23 +678,7 @@ static int log_notify(struct blob_attr *msg)
 				strncat(buf, "kernel: ", sizeof(buf) - strlen(buf) - 1);
 			strncat(buf, m, sizeof(buf) - strlen(buf) - 1);
 		}
-		if (log_udp)
-			err = write(sender.fd, buf, strlen(buf));
-		else {
-			size_t buflen = strlen(buf);
-			if (!log_trailer_null)
-				buf[buflen] = '\n';
-			err = send(sender.fd, buf, buflen + 1, 0);
-		}
-
-		if (err < 0) {
-			syslog(LOG_INFO, "failed to send log data to %s:%s via %s\n",
-				log_ip, log_port, (log_udp) ? ("udp") : ("tcp"));
-			uloop_fd_delete(&sender);
-			close(sender.fd);
-			sender.fd = -1;
-			uloop_timeout_set(&retry, 1000);
-		}
+		log_queue_add(blobmsg_get_u32(tb[LOG_ID]), buf, strlen(buf));
 	} else {
 		if (!log_template) {
 			snprintf(buf, sizeof(buf), "%s %s%s.%s%s %s\n",
@@ -306,13 +692,12 @@ static int log_notify(struct blob_attr *msg)
 			buf[buflen++] = '\n';
 			buf[buflen] = '\0';
 		}
-		ret = write(sender.fd, buf, strlen(buf));
+		if (log_type == LOG_FILE)
+			ret = log_file_write(buf, strlen(buf));
+		else
+			ret = write(sender.fd, buf, strlen(buf));
 	}
 
-	free(str);
-	if (log_type == LOG_FILE)
-		fsync(sender.fd);
-
 	return ret;
 }
 
@@ -326,14 +711,24 @@ static int usage(const char *prog)
 		"    -r	<server> <port>	Stream message to a server\n"
 		"    -F	<file>		Log file\n"
 		"    -S	<bytes>		Log size\n"
+		"    -G	<count>		Number of rotated log files to keep\n"
+		"    -z			Compress rotated log files with gzip\n"
+		"    -I	<msecs>		Sync the log file at most every 'msecs'\n"
+		"    -B	<bytes>		Sync the log file after 'bytes' were written\n"
 		"    -p	<file>		PID file\n"
 		"    -h	<hostname>	Add hostname to the message\n"
 		"    -P	<prefix>	Prefix custom text to streamed messages\n"
 		"    -T	<template>	Custom log output template\n"
+		"    -x	<file>		Save a raw snapshot of the log buffer, - for stdout\n"
+		"    -X	<file>		Print the messages of a saved snapshot\n"
 		"    -f			Follow log messages\n"
 		"    -u			Use UDP as the protocol\n"
 		"    -t			Add an extra timestamp\n"
 		"    -0			Use \\0 instead of \\n as trailer when using TCP\n"
+		"    -O			Use RFC6587 octet counting framing when using TCP\n"
+		"    -5			Use the RFC5424 message format when streaming\n"
+		"    --since <time>	Only messages logged at or after an RFC3339 time\n"
+		"    --until <time>	Only messages logged at or before an RFC3339 time\n"
 		"\n", prog);
 	return 1;
 }
@@ -355,31 +750,184 @@ static void logread_fd_data_cb(struct ustream *s, int bytes)
 		log_notify(a);
 		ustream_consume(s, cur_len);
 	}
-	if (!log_follow)
+	if (!log_follow) {
+		if (log_type == LOG_NET)
+			log_queue_flush();
 		uloop_end();
+	}
 }
 
 static void logread_fd_cb(struct ubus_request *req, int fd)
 {
-	static struct ustream_fd test_fd;
+	log_stream.stream.notify_read = logread_fd_data_cb;
+	ustream_fd_init(&log_stream, fd);
+}
+
+static void snapshot_fd_cb(struct ubus_request *req, int fd)
+{
+	int out = STDOUT_FILENO;
+	ssize_t ret;
+
+	if (strcmp(snapshot_out, "-"))
+		out = open(snapshot_out, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+	if (out < 0) {
+		fprintf(stderr, "failed to open %s: %s\n", snapshot_out, strerror(errno));
+		close(fd);
+		return;
+	}
 
-	test_fd.stream.notify_read = logread_fd_data_cb;
-	ustream_fd_init(&test_fd, fd);
+	do {
+		ret = sendfile(out, fd, NULL, INT_MAX);
+	} while ((ret > 0) || ((ret < 0) && (errno == EINTR)));
+	if (ret < 0)
+		fprintf(stderr, "failed to write %s: %s\n", snapshot_out, strerror(errno));
+
+	close(fd);
+	if (out != STDOUT_FILENO)
+		close(out);
 }
 
-int main(int argc, char **argv)
+static int log_snapshot_export(void)
+{
+	struct ubus_request req;
+	int ret;
+
+	blob_buf_init(&b, 0);
+	ret = ubus_invoke_async(ctx, log_object, "snapshot", b.head, &req);
+	if (!ret) {
+		req.fd_cb = snapshot_fd_cb;
+		ret = ubus_complete_request(ctx, &req, 5000);
+	}
+	if (ret)
+		fprintf(stderr, "Failed to get snapshot: %s\n", ubus_strerror(ret));
+
+	return ret;
+}
+
+static int log_parse_time(const char *str, timestamp_t *ts, uint64_t *ms)
+{
+	if (timestamp_parse(str, strlen(str), ts) || (ts->sec < 0)) {
+		fprintf(stderr, "Invalid RFC3339 time: %s\n", str);
+		return -1;
+	}
+	*ms = (ts->sec * 1000) + (ts->nsec / 1000000);
+
+	return 0;
+}
+
+static int log_snapshot_decode(const char *path)
+{
+	struct log_snapshot *hdr;
+	struct log_head *h;
+	struct stat s;
+	char *p, *end;
+	uint64_t t;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if ((fd < 0) || fstat(fd, &s)) {
+		fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	hdr = (s.st_size < sizeof(*hdr)) ? (MAP_FAILED) :
+		mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if ((hdr == MAP_FAILED) || (hdr->magic != LOG_SNAPSHOT_MAGIC) ||
+	    (hdr->version != LOG_SNAPSHOT_VERSION) ||
+	    (hdr->head_size != sizeof(struct log_head)) ||
+	    (hdr->len > s.st_size - sizeof(*hdr))) {
+		fprintf(stderr, "%s is not a log snapshot\n", path);
+		if (hdr != MAP_FAILED)
+			munmap(hdr, s.st_size);
+		return -1;
+	}
+
+	p = (char *) &hdr[1];
+	end = p + hdr->len;
+	while (p + sizeof(*h) <= end) {
+		h = (struct log_head *) p;
+		if (!h->size || (h->size > (size_t) (end - h->data)) || h->data[h->size - 1] ||
+		    (h->tag_len >= h->size))
+			break;
+
+		t = (((uint64_t) h->ts.tv_sec) * 1000) + (h->ts.tv_nsec / 1000000);
+		if ((log_since_ms && (t < log_since_ms)) || (log_until_ms && (t > log_until_ms))) {
+			p = &h->data[PAD(h->size)];
+			continue;
+		}
+
+		blob_buf_init(&b, 0);
+		blobmsg_add_string(&b, "msg", h->data);
+		blobmsg_add_u32(&b, "id", h->id);
+		blobmsg_add_u32(&b, "priority", h->priority);
+		blobmsg_add_u32(&b, "source", h->source);
+		blobmsg_add_u64(&b, "time", t);
+		if (h->tag_len) {
+			char *tag = blobmsg_alloc_string_buffer(&b, "tag", h->tag_len + 1);
+
+			memcpy(tag, h->data, h->tag_len);
+			tag[h->tag_len] = '\0';
+			blobmsg_add_string_buffer(&b);
+		}
+		if (h->pid)
+			blobmsg_add_u32(&b, "pid", h->pid);
+		log_notify(b.head);
+
+		p = &h->data[PAD(h->size)];
+	}
+	munmap(hdr, s.st_size);
+
+	return 0;
+}
+
+static void log_request(bool resume)
 {
 	static struct ubus_request req;
-	struct ubus_context *ctx;
-	uint32_t id;
+
+	blob_buf_init(&b, 0);
+	blobmsg_add_u8(&b, "stream", 1);
+	if (resume)
+		blobmsg_add_u32(&b, "since_id", queue_last_id);
+	else if (log_lines)
+		blobmsg_add_u32(&b, "lines", log_lines);
+	else if (log_follow)
+		blobmsg_add_u32(&b, "lines", 0);
+	if (regexp_pattern) {
+		blobmsg_add_string(&b, "match", regexp_pattern);
+		blobmsg_add_u8(&b, "regex", 1);
+	}
+	if (log_since_ms)
+		blobmsg_add_u64(&b, "since", log_since_ms);
+	if (log_until_ms)
+		blobmsg_add_u64(&b, "until", log_until_ms);
+
+	ubus_invoke_async(ctx, log_object, "read", b.head, &req);
+	req.fd_cb = logread_fd_cb;
+	ubus_complete_request_async(ctx, &req);
+}
+
+enum {
+	OPT_SINCE = 0x100,
+	OPT_UNTIL,
+};
+
+static const struct option long_options[] = {
+	{ "since", required_argument, NULL, OPT_SINCE },
+	{ "until", required_argument, NULL, OPT_UNTIL },
+	{ NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char **argv)
+{
 	const char *ubus_socket = NULL;
-	int ch, ret, lines = 0;
-	static struct blob_buf b;
+	int ch, ret;
 	int tries = 5;
 
 	signal(SIGPIPE, SIG_IGN);
 
-	while ((ch = getopt(argc, argv, "u0fcs:l:r:F:p:S:P:h:e:tT:")) != -1) {
+	while ((ch = getopt_long(argc, argv, "u0O5fczs:l:r:F:p:S:G:I:B:P:h:e:tT:x:X:",
+				 long_options, NULL)) != -1) {
 		switch (ch) {
 		case 'u':
 			log_udp = 1;
@@ -387,6 +935,12 @@ int main(int argc, char **argv)
 		case '0':
 			log_trailer_null = 1;
 			break;
+		case 'O':
+			log_octet_count = 1;
+			break;
+		case '5':
+			log_rfc5424 = 1;
+			break;
 		case 's':
 			ubus_socket = optarg;
 			break;
@@ -407,7 +961,7 @@ int main(int argc, char **argv)
 			log_follow = 1;
 			break;
 		case 'l':
-			lines = atoi(optarg);
+			log_lines = atoi(optarg);
 			break;
 		case 'S':
 			log_size = atoi(optarg);
@@ -415,26 +969,78 @@ int main(int argc, char **argv)
 				log_size = 1;
 			log_size *= 1024;
 			break;
+		case 'G':
+			log_generations = atoi(optarg);
+			if (log_generations < 1)
+				log_generations = 1;
+			break;
+		case 'z':
+			log_compress = 1;
+			break;
+		case 'I':
+			log_sync_interval = atoi(optarg);
+			break;
+		case 'B':
+			log_sync_bytes = atoi(optarg);
+			break;
 		case 'h':
 			hostname = optarg;
 			break;
 		case 'e':
+			/* logd does the matching, only make sure the pattern is valid */
 			if (!regcomp(&regexp_preg, optarg, REG_NOSUB)) {
 				regexp_pattern = optarg;
+				regfree(&regexp_preg);
 			}
 			break;
 		case 't':
 			log_timestamp = 1;
 			break;
+		case 'x':
+			snapshot_out = optarg;
+			break;
+		case 'X':
+			snapshot_in = optarg;
+			break;
 		case 'T':
 			log_template = optarg;
+			if (tpl_compile(log_template))
+				return 1;
+			break;
+		case OPT_SINCE:
+			if (log_parse_time(optarg, &log_since, &log_since_ms))
+				return 1;
+			break;
+		case OPT_UNTIL:
+			if (log_parse_time(optarg, &log_until, &log_until_ms))
+				return 1;
 			break;
 		default:
 			return usage(*argv);
 		}
 	}
+
+	if (log_since_ms && log_until_ms && (timestamp_compare(&log_since, &log_until) > 0)) {
+		fprintf(stderr, "--since is after --until\n");
+		return 1;
+	}
 	uloop_init();
 
+	/* offline decoding, logd is not needed for that */
+	if (snapshot_in) {
+		if (log_file) {
+			log_type = LOG_FILE;
+			sync_timer.cb = log_handle_sync;
+			log_file_open();
+		} else {
+			sender.fd = STDOUT_FILENO;
+		}
+		ret = log_snapshot_decode(snapshot_in);
+		if (log_type == LOG_FILE)
+			log_file_sync();
+		return ret;
+	}
+
 	ctx = ubus_connect(ubus_socket);
 	if (!ctx) {
 		fprintf(stderr, "Failed to connect to ubus\n");
@@ -444,19 +1050,19 @@ int main(int argc, char **argv)
 
 	/* ugly ugly ugly ... we need a real reconnect logic */
 	do {
-		ret = ubus_lookup_id(ctx, "log", &id);
+		ret = ubus_lookup_id(ctx, "log", &log_object);
 		if (ret) {
 			fprintf(stderr, "Failed to find log object: %s\n", ubus_strerror(ret));
 			sleep(1);
 			continue;
 		}
 
-		blob_buf_init(&b, 0);
-		blobmsg_add_u8(&b, "stream", 1);
-		if (lines)
-			blobmsg_add_u32(&b, "lines", lines);
-		else if (log_follow)
-			blobmsg_add_u32(&b, "lines", 0);
+		if (snapshot_out) {
+			ret = log_snapshot_export();
+			ubus_free(ctx);
+			return ret;
+		}
+
 		if (log_follow) {
 			if (pid_file) {
 				FILE *fp = fopen(pid_file, "w+");
@@ -471,24 +1077,24 @@ int main(int argc, char **argv)
 			openlog("logread", LOG_PID, LOG_DAEMON);
 			log_type = LOG_NET;
 			sender.cb = log_handle_fd;
+			sender.fd = -1;
 			retry.cb = log_handle_reconnect;
+			flush_timer.cb = log_handle_flush;
+			resume_timer.cb = log_handle_resume;
 			uloop_timeout_set(&retry, 1000);
 		} else if (log_file) {
 			log_type = LOG_FILE;
-			sender.fd = open(log_file, O_CREAT | O_WRONLY| O_APPEND, 0600);
-			if (sender.fd < 0) {
-				fprintf(stderr, "failed to open %s: %s\n", log_file, strerror(errno));
-				exit(-1);
-			}
+			sync_timer.cb = log_handle_sync;
+			log_file_open();
 		} else {
 			sender.fd = STDOUT_FILENO;
 		}
 
-		ubus_invoke_async(ctx, id, "read", b.head, &req);
-		req.fd_cb = logread_fd_cb;
-		ubus_complete_request_async(ctx, &req);
+		log_request(false);
 
 		uloop_run();
+		if (log_type == LOG_FILE)
+			log_file_sync();
 		ubus_free(ctx);
 		uloop_done();
 
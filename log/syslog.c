@@ -11,17 +11,23 @@
  * GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE
 #include <linux/un.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
+#include <ctype.h>
+#include <stdarg.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <regex.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
 #include <syslog.h>
@@ -29,6 +35,7 @@
 #include <libubox/uloop.h>
 #include <libubox/usock.h>
 #include <libubox/ustream.h>
+#include <libubox/utils.h>
 
 #include "syslog.h"
 
@@ -36,17 +43,88 @@
 #define LOG_DEFAULT_SOCKET	"/dev/log"
 #define LOG_LINE_LEN		256
 #define SYSLOG_PADDING		16
+#define SYSLOG_BATCH		16
+#define SYSLOG_DGRAM_LEN	1024
+#define LOG_INDEX_STRIDE	16
+#define LOG_STORE_MAGIC		0x6c6f6764
+#define LOG_LIMIT_SLOTS		64
+#define LOG_LIMIT_WAYS		4
+#define LOG_LIMIT_NAME		32
+#define LOG_STORE_VERSION	2
+#define LOG_TAG_SCAN		64
+#define LOG_TAG_MAX		256
+#define LOG_REPEAT_FLUSH	10000
+#define LOG_REORDER_MS		1000
 
 #define KLOG_DEFAULT_PROC	"/proc/kmsg"
+#define KLOG_DEFAULT_KMSG	"/dev/kmsg"
+#define KLOG_BOOT_ID		"/proc/sys/kernel/random/boot_id"
+#define KLOG_RECORD_LEN		8192
 
-#define PAD(x) (x % 4) ? (((x) - (x % 4)) + 4) : (x)
+/* header in front of a file backed ring, offsets are relative to the ring */
+struct log_store {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t oldest;
+	uint32_t newest;
+	uint32_t current_id;
+	uint32_t version;
+	uint32_t klog_seq;	/* last /dev/kmsg record + 1, 0 if none */
+	uint32_t klog_boot;	/* hash of the boot id klog_seq belongs to */
+};
+
+/* "tag[pid]: " in front of a syslog message */
+struct log_tag {
+	int len;
+	int pid;
+	int msg;
+};
 
 static char *log_dev = LOG_DEFAULT_SOCKET;
 static int log_size = LOG_DEFAULT_SIZE;
 static struct log_head *log, *log_end, *oldest, *newest;
 static int current_id = 0;
-static regex_t pat_prio;
-static regex_t pat_tstamp;
+static unsigned int *log_index;
+static int log_index_size;
+static unsigned int log_sorted_id;	/* entries from this id on are in time order */
+static uint64_t log_last_time;		/* latest time since log_sorted_id */
+static struct log_store *store;
+static const char *store_path;
+
+/* token bucket of one source + tag[pid], tokens are in 1/1000 messages */
+struct log_limit {
+	uint32_t key;
+	unsigned int tokens;
+	unsigned int suppressed;
+	uint64_t last;
+	int priority;			/* of the last suppressed message */
+	char name[LOG_LIMIT_NAME];	/* tag[pid] or source, for the report */
+};
+
+/* last message of a source, to coalesce repeats */
+struct log_repeat {
+	uint32_t hash;
+	int size;
+	int priority;
+	unsigned int count;
+	unsigned int id;	/* of the stored message, to compare the content */
+};
+
+static struct log_limit log_limit[LOG_LIMIT_SLOTS];
+static unsigned int log_limit_evicted;	/* suppressed by buckets since evicted */
+static uint64_t log_limit_reported;
+static struct log_repeat log_repeat[SOURCE_INTERNAL + 1];
+static struct uloop_timeout repeat_timer;
+
+/* interned tags, id 0 is "no tag" and used once the table is full */
+static char *log_tags[LOG_TAG_MAX];
+static unsigned short log_tag_hash[LOG_TAG_MAX * 2];
+static int log_tag_count = 1;
+
+struct log_stats log_stats;
+struct log_limits log_limits = {
+	.burst = 100,
+};
 
 static struct log_head*
 log_next(struct log_head *h, int size)
@@ -56,99 +134,539 @@ log_next(struct log_head *h, int size)
 	return (n >= log_end) ? (log) : (n);
 }
 
+static uint64_t
+log_head_time(const struct log_head *h)
+{
+	return (((uint64_t) h->ts.tv_sec) * 1000) + (h->ts.tv_nsec / 1000000);
+}
+
+/*
+ * Kernel messages carry the time they were logged at and may arrive after
+ * newer syslog messages. The ring counts as in time order as long as no
+ * entry is more than LOG_REORDER_MS older than one before it, a larger
+ * step back means the clock was set back and starts a new ordered run.
+ * The timestamps themselves are never changed.
+ */
+static void
+log_order(struct log_head *h)
+{
+	uint64_t t = log_head_time(h);
+
+	if (t + LOG_REORDER_MS < log_last_time) {
+		log_sorted_id = h->id;
+		log_last_time = t;
+	} else if (t > log_last_time) {
+		log_last_time = t;
+	}
+}
+
+static bool
+log_sorted(void)
+{
+	return (oldest != newest) && (oldest->id >= log_sorted_id);
+}
+
+/*
+ * Every LOG_INDEX_STRIDE'th entry has its offset recorded in a circular
+ * index keyed by id, which bounds any seek to LOG_INDEX_STRIDE steps.
+ */
+static void
+log_index_add(struct log_head *h)
+{
+	if (h->id % LOG_INDEX_STRIDE)
+		return;
+
+	log_index[(h->id / LOG_INDEX_STRIDE) % log_index_size] = (char *) h - (char *) log;
+}
+
+/*
+ * Walk over the "<PRI>" header and the RFC3164 or kernel "[ sec.usec] "
+ * timestamp in a single forward scan. Returns the number of leading bytes
+ * that are not part of the message itself.
+ */
+static int
+log_strip_prefix(const char *buf, int len, int source, int *priority)
+{
+	const char *p = buf, *end = buf + len, *q;
+	int prio = 0;
+
+	/* "<PRI>" carries 1-3 digits */
+	if (p < end && *p == '<') {
+		for (q = p + 1; q < end && q < p + 4 && isdigit(*q); q++)
+			prio = prio * 10 + (*q - '0');
+		if (q < end && *q == '>') {
+			*priority = prio;
+			p = q + 1;
+		}
+	}
+
+	switch (source) {
+	case SOURCE_KLOG:
+		if (p >= end || *p != '[')
+			break;
+		for (q = p + 1; q < end && *q == ' '; q++)
+			;
+		while (q < end && isdigit(*q))
+			q++;
+		if (q >= end || *q++ != '.')
+			break;
+		while (q < end && isdigit(*q))
+			q++;
+		if ((end - q) >= 2 && q[0] == ']' && q[1] == ' ')
+			p = q + 2;
+		break;
+
+	case SOURCE_SYSLOG:
+		/* "Mmm dd hh:mm:ss " */
+		if ((end - p) >= SYSLOG_PADDING && p[3] == ' ' && p[6] == ' ' &&
+		    p[9] == ':' && p[12] == ':' && p[SYSLOG_PADDING - 1] == ' ')
+			p += SYSLOG_PADDING;
+		break;
+	}
+
+	return p - buf;
+}
+
+static uint32_t
+log_hash(uint32_t hash, const char *buf, int len)
+{
+	/* FNV-1a */
+	while (len--)
+		hash = (hash ^ (unsigned char) *buf++) * 16777619;
+
+	return hash;
+}
+
+static uint64_t
+log_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (((uint64_t) ts.tv_sec) * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static void
+log_parse_tag(const char *buf, int len, struct log_tag *t)
+{
+	const char *p, *end = buf + ((len < LOG_TAG_SCAN) ? (len) : (LOG_TAG_SCAN));
+	int pid = 0;
+
+	memset(t, 0, sizeof(*t));
+	for (p = buf; (p < end) && (*p != '[') && (*p != ':'); p++)
+		if (isspace(*p))
+			return;
+	if ((p == buf) || (p >= end))
+		return;
+	t->len = p - buf;
+
+	if (*p == '[') {
+		for (p++; (p < end) && isdigit(*p); p++)
+			pid = pid * 10 + (*p - '0');
+		if ((p >= end) || (*p++ != ']'))
+			goto out;
+	}
+	if ((p >= end) || (*p++ != ':'))
+		goto out;
+	if ((p < end) && (*p == ' '))
+		p++;
+
+	t->pid = pid;
+	t->msg = p - buf;
+	return;
+
+out:
+	t->len = 0;
+}
+
+/* returns the interned id of a tag, 0 if unknown and add is not set */
+unsigned short
+log_tag_intern(const char *tag, int len, bool add)
+{
+	unsigned int slot = log_hash(2166136261u, tag, len) % ARRAY_SIZE(log_tag_hash);
+	unsigned short id;
+
+	if (!len)
+		return 0;
+
+	while ((id = log_tag_hash[slot])) {
+		if (!strncmp(log_tags[id], tag, len) && !log_tags[id][len])
+			return id;
+		slot = (slot + 1) % ARRAY_SIZE(log_tag_hash);
+	}
+
+	if (!add || (log_tag_count == LOG_TAG_MAX))
+		return 0;
+
+	log_tags[log_tag_count] = strndup(tag, len);
+	if (!log_tags[log_tag_count])
+		return 0;
+	log_tag_hash[slot] = log_tag_count;
+
+	return log_tag_count++;
+}
+
+static void log_insert(const char *buf, int size, int source, int priority,
+		       const struct log_tag *t, const struct timespec *ts);
+
+static void
+log_insertf(int source, int priority, const char *fmt, ...)
+{
+	char buf[LOG_LINE_LEN];
+	struct log_tag t;
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+
+	log_parse_tag(buf, len, &t);
+	log_insert(buf, len + 1, source, priority, &t, NULL);
+}
+
+static void
+log_limit_flush(struct log_limit *l)
+{
+	if (!l->suppressed)
+		return;
+
+	log_insertf(SOURCE_INTERNAL, l->priority, "logd: suppressed %u messages from %s",
+		l->suppressed, l->name);
+	l->suppressed = 0;
+}
+
+/* the bucket of key in its set, or the least recently used one to evict */
+static struct log_limit*
+log_limit_find(uint32_t key)
+{
+	struct log_limit *set, *victim;
+	int i;
+
+	set = &log_limit[(key % (LOG_LIMIT_SLOTS / LOG_LIMIT_WAYS)) * LOG_LIMIT_WAYS];
+	victim = set;
+	for (i = 0; i < LOG_LIMIT_WAYS; i++) {
+		if (set[i].last && (set[i].key == key))
+			return &set[i];
+		if (set[i].last < victim->last)
+			victim = &set[i];
+	}
+
+	return victim;
+}
+
+/*
+ * Charge a message to the bucket of its source and "tag[pid]" prefix.
+ * Returns false if the message is over the limit and has to be dropped.
+ */
+static bool
+log_limit_check(const char *buf, const struct log_tag *t, int source, int priority)
+{
+	struct log_limit *l;
+	unsigned int cap;
+	uint64_t now;
+	uint32_t key;
+
+	if (!log_limits.rate || (source == SOURCE_INTERNAL))
+		return true;
+
+	key = log_hash(2166136261u ^ source, buf, t->len);
+	key = log_hash(key, (const char *) &t->pid, sizeof(t->pid));
+
+	now = log_time_ms();
+	cap = log_limits.burst * 1000;
+	l = log_limit_find(key);
+	if (!l->last)
+		l->tokens = cap;
+	else if ((now - l->last) * log_limits.rate >= cap - l->tokens)
+		l->tokens = cap;
+	else
+		l->tokens += (now - l->last) * log_limits.rate;
+	l->last = now;
+
+	/*
+	 * an evicted bucket keeps its tokens, more busy keys than ways in a
+	 * set share one bucket instead of refilling each other's. What it
+	 * held back is reported at most once a second, a thrashing set would
+	 * flood the ring with reports otherwise.
+	 */
+	if (l->key != key || !l->name[0]) {
+		log_limit_evicted += l->suppressed;
+		l->suppressed = 0;
+		l->key = key;
+		if (t->len)
+			snprintf(l->name, sizeof(l->name), "%.*s", t->len, buf);
+		else
+			strcpy(l->name, (source == SOURCE_KLOG) ? ("kernel") : ("syslog"));
+	}
+
+	if (log_limit_evicted && (now - log_limit_reported >= 1000)) {
+		log_insertf(SOURCE_INTERNAL, LOG_DAEMON | LOG_NOTICE,
+			"logd: suppressed %u messages from evicted sources", log_limit_evicted);
+		log_limit_evicted = 0;
+		log_limit_reported = now;
+	}
+
+	if (l->tokens < 1000) {
+		l->suppressed++;
+		l->priority = priority;
+		log_stats.limited++;
+		return false;
+	}
+	l->tokens -= 1000;
+
+	if (l->suppressed) {
+		l->priority = priority;
+		log_limit_flush(l);
+	}
+
+	return true;
+}
+
+static void
+log_repeat_flush(struct log_repeat *r, int source)
+{
+	if (!r->count)
+		return;
+
+	log_insertf(source, r->priority, "last message repeated %u times", r->count);
+	r->count = 0;
+}
+
+static void
+log_repeat_timeout(struct uloop_timeout *t)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(log_repeat); i++)
+		log_repeat_flush(&log_repeat[i], i);
+}
+
+/* returns true if the message repeats the previous one of its source */
+static bool
+log_repeat_check(const char *buf, int size, int source, int priority)
+{
+	struct log_repeat *r;
+	uint32_t hash;
+
+	if (!log_limits.dedup || (source >= ARRAY_SIZE(log_repeat)))
+		return false;
+
+	r = &log_repeat[source];
+	hash = log_hash(2166136261u, buf, size);
+	if ((hash == r->hash) && (size == r->size) && (priority == r->priority)) {
+		struct log_head *h = log_find(r->id);
+
+		/* the hash may collide, and the message may have been dropped or evicted */
+		if (!h || (h->id != r->id) || (h->source != source) || (h->size != size) ||
+		    memcmp(h->data, buf, size - 1))
+			goto update;
+
+		if (!r->count++) {
+			repeat_timer.cb = log_repeat_timeout;
+			uloop_timeout_set(&repeat_timer, LOG_REPEAT_FLUSH);
+		}
+		log_stats.repeated++;
+		return true;
+	}
+
+update:
+	log_repeat_flush(r, source);
+	r->id = current_id;
+	r->hash = hash;
+	r->size = size;
+	r->priority = priority;
+
+	return false;
+}
+
+/* count the time since start into a histogram of LOG_HIST_BUCKETS */
+static void
+log_hist_add(unsigned int *hist, const struct timespec *start)
+{
+	struct timespec now;
+	uint64_t us;
+	int i = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = ((now.tv_sec - start->tv_sec) * 1000000) + ((now.tv_nsec - start->tv_nsec) / 1000);
+	while (us && (i < LOG_HIST_BUCKETS - 1)) {
+		us >>= 2;
+		i++;
+	}
+	hist[i]++;
+}
+
+static void
+log_ingest(char *buf, int size, int source, int priority, const struct timespec *ts)
+{
+	struct log_tag t = { 0 };
+
+	if (source < ARRAY_SIZE(log_stats.ingest)) {
+		log_stats.ingest[source].messages++;
+		log_stats.ingest[source].bytes += size;
+	}
+
+	if (log_repeat_check(buf, size, source, priority))
+		return;
+	if (source != SOURCE_KLOG)
+		log_parse_tag(buf, size - 1, &t);
+	if (!log_limit_check(buf, &t, source, priority))
+		return;
+
+	log_insert(buf, size, source, priority, &t, ts);
+	if (source < ARRAY_SIZE(log_repeat))
+		log_repeat[source].id = current_id - 1;
+}
+
 void
 log_add(char *buf, int size, int source)
 {
-	regmatch_t matches[4];
-	struct log_head *next;
+	struct timespec start;
 	int priority = 0;
-	int ret;
+	int skip;
 
-	/* bounce out if we don't have init'ed yet (regmatch etc will blow) */
+	/* bounce out if we don't have init'ed yet */
 	if (!log) {
 		fprintf(stderr, "%s", buf);
 		return;
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
 	/* strip trailing newline */
-	if (buf[size - 2] == '\n') {
+	if (size > 1 && buf[size - 2] == '\n') {
 		buf[size - 2] = '\0';
 		size -= 1;
 	}
 
-	/* strip the priority */
-	ret = regexec(&pat_prio, buf, 3, matches, 0);
-	if (!ret) {
-		priority = atoi(&buf[matches[1].rm_so]);
-		size -= matches[2].rm_so;
-		buf += matches[2].rm_so;
-	}
+	/* strip the priority and timestamp */
+	skip = log_strip_prefix(buf, size - 1, source, &priority);
+	size -= skip;
+	buf += skip;
 
-#if 0
-	/* strip kernel timestamp */
-	ret = regexec(&pat_tstamp,buf, 4, matches, 0);
-	if ((source == SOURCE_KLOG) && !ret) {
-		size -= matches[3].rm_so;
-		buf += matches[3].rm_so;
-	}
-#endif
+	//fprintf(stderr, "-> %d - %s\n", priority, buf);
+
+	log_ingest(buf, size, source, priority, NULL);
+	log_hist_add(log_stats.ingest_time, &start);
+}
 
-	/* strip syslog timestamp */
-	if ((source == SOURCE_SYSLOG) && (size > SYSLOG_PADDING) && (buf[SYSLOG_PADDING - 1] == ' ')) {
-		size -= SYSLOG_PADDING;
-		buf += SYSLOG_PADDING;
+/* account the entries between from and the new oldest as overwritten */
+static void
+log_evict(struct log_head *from)
+{
+	while (from != oldest) {
+		if (!from->size) {
+			from = log;
+			continue;
+		}
+		log_stats.evicted.messages++;
+		log_stats.evicted.bytes += from->size;
+		from = log_next(from, from->size);
 	}
+}
 
-	//fprintf(stderr, "-> %d - %s\n", priority, buf);
+static void
+log_insert(const char *buf, int size, int source, int priority,
+	   const struct log_tag *t, const struct timespec *ts)
+{
+	struct log_head *next, *prev = (oldest != newest) ? (oldest) : (NULL);
 
 	/* find new oldest entry */
 	next = log_next(newest, size);
 	if (next > newest) {
-		while ((oldest > newest) && (oldest <= next) && (oldest != log))
+		while ((oldest > newest) && (oldest <= next) && (oldest != log)) {
 			oldest = log_next(oldest, oldest->size);
+			/* the wrap marker ends the previous pass */
+			if (!oldest->size)
+				oldest = log;
+		}
 	} else {
 		//fprintf(stderr, "Log wrap\n");
 		newest->size = 0;
 		next = log_next(log, size);
-		for (oldest = log; oldest <= next; oldest = log_next(oldest, oldest->size))
+		for (oldest = log; oldest->size && (oldest <= next); oldest = log_next(oldest, oldest->size))
 			;
+		if (!oldest->size)
+			oldest = log;
 		newest = log;
 	}
+	if (prev)
+		log_evict(prev);
+	if (store)
+		store->oldest = (char *) oldest - (char *) log;
 
 	/* add the log message */
 	newest->size = size;
 	newest->id = current_id++;
 	newest->priority = priority;
 	newest->source = source;
-	clock_gettime(CLOCK_REALTIME, &newest->ts);
-	strcpy(newest->data, buf);
+	newest->pid = t->pid;
+	newest->tag = log_tag_intern(buf, t->len, true);
+	newest->tag_len = t->len;
+	newest->msg = t->msg;
+	if (ts)
+		newest->ts = *ts;
+	else
+		clock_gettime(CLOCK_REALTIME, &newest->ts);
+	log_order(newest);
+	memcpy(newest->data, buf, size - 1);
+	newest->data[size - 1] = '\0';
+	log_index_add(newest);
 
 	ubus_notify_log(newest);
 
 	newest = next;
+	if (store) {
+		store->newest = (char *) newest - (char *) log;
+		store->current_id = current_id;
+	}
 }
 
 static void
-slog_cb(struct ustream *s, int bytes)
+slog_cb(struct uloop_fd *u, unsigned int events)
 {
-	struct ustream_buf *buf = s->r.head;
-	char *str;
-	int len;
+	static char buf[SYSLOG_BATCH][SYSLOG_DGRAM_LEN];
+	static char cbuf[SYSLOG_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+	struct mmsghdr msgs[SYSLOG_BATCH];
+	struct iovec iov[SYSLOG_BATCH];
+	struct cmsghdr *cmsg;
+	int i, n, len;
 
 	do {
-		str = ustream_get_read_buf(s, NULL);
-		if (!str)
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < SYSLOG_BATCH; i++) {
+			iov[i].iov_base = buf[i];
+			iov[i].iov_len = sizeof(buf[i]) - 1;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = cbuf[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(cbuf[i]);
+		}
+
+		n = recvmmsg(u->fd, msgs, SYSLOG_BATCH, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
 			break;
-		len = strlen(buf->data);
-		if (!len) {
-			bytes -= 1;
-			ustream_consume(s, 1);
-			continue;
 		}
-		log_add(buf->data, len + 1, SOURCE_SYSLOG);
-		ustream_consume(s, len);
-		bytes -= len;
-	} while (bytes > 0);
+
+		for (i = 0; i < n; i++) {
+			struct msghdr *h = &msgs[i].msg_hdr;
+
+			for (cmsg = CMSG_FIRSTHDR(h); cmsg; cmsg = CMSG_NXTHDR(h, cmsg))
+				if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+					memcpy(&log_stats.dropped, CMSG_DATA(cmsg), sizeof(uint32_t));
+
+			buf[i][msgs[i].msg_len] = '\0';
+			len = strlen(buf[i]);
+			if (len)
+				log_add(buf[i], len + 1, SOURCE_SYSLOG);
+		}
+	} while (n == SYSLOG_BATCH);
 }
 
 static void
@@ -172,9 +690,79 @@ klog_cb(struct ustream *s, int bytes)
 	} while (1);
 }
 
-struct ustream_fd slog = {
-	.stream.string_data = true,
-	.stream.notify_read = slog_cb,
+static struct uloop_fd slog = {
+	.cb = slog_cb,
+};
+
+static uint64_t kmsg_seq;
+static uint32_t kmsg_boot;
+static bool kmsg_resume;
+
+/*
+ * Every read() on /dev/kmsg returns a single "pri,seq,usec,flags;text\n"
+ * record, optionally followed by " KEY=value" lines that are ignored.
+ */
+static void
+kmsg_cb(struct uloop_fd *u, unsigned int events)
+{
+	static char buf[KLOG_RECORD_LEN];
+	struct timespec start, mono, ts;
+	unsigned long long seq, usec;
+	unsigned int pri;
+	char *msg, *end;
+	int64_t off;
+	int len, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	off = ((int64_t) ts.tv_sec - mono.tv_sec) * 1000000 + (ts.tv_nsec - mono.tv_nsec) / 1000;
+
+	while (1) {
+		len = read(u->fd, buf, sizeof(buf) - 1);
+		if (len < 0) {
+			/* EPIPE: the record was overwritten, the next read catches up */
+			if ((errno == EINTR) || (errno == EPIPE))
+				continue;
+			break;
+		}
+		if (!len)
+			break;
+		buf[len] = '\0';
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		/* %n is only set if the flags field follows */
+		n = 0;
+		if ((sscanf(buf, "%u,%llu,%llu,%n", &pri, &seq, &usec, &n) < 3) ||
+		    !(msg = strchr(buf + n, ';')))
+			continue;
+		msg++;
+		end = strchr(msg, '\n');
+		if (end)
+			*end = '\0';
+		else
+			end = buf + len;
+
+		if (kmsg_resume && (seq < kmsg_seq))
+			continue;
+		if (kmsg_resume && (seq > kmsg_seq))
+			log_stats.kernel_dropped += seq - kmsg_seq;
+		kmsg_resume = true;
+		kmsg_seq = seq + 1;
+		if (store)
+			store->klog_seq = kmsg_seq;
+
+		/* the record carries the monotonic time it was logged at */
+		usec += off;
+		ts.tv_sec = usec / 1000000;
+		ts.tv_nsec = (usec % 1000000) * 1000;
+		log_ingest(msg, end - msg + 1, SOURCE_KLOG, pri, &ts);
+		log_hist_add(log_stats.ingest_time, &start);
+	}
+}
+
+static struct uloop_fd kmsg = {
+	.cb = kmsg_cb,
+	.fd = -1,
 };
 
 struct ustream_fd klog = {
@@ -182,11 +770,59 @@ struct ustream_fd klog = {
 	.stream.notify_read = klog_cb,
 };
 
+static uint32_t
+klog_boot_id(void)
+{
+	char buf[64];
+	int fd, len;
+
+	fd = open(KLOG_BOOT_ID, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	len = read(fd, buf, sizeof(buf));
+	close(fd);
+
+	return (len > 0) ? (log_hash(2166136261u, buf, len) | 1) : (0);
+}
+
+static int
+kmsg_open(void)
+{
+	int fd;
+
+	fd = open(KLOG_DEFAULT_KMSG, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	/* pick up where the stored ring left off if it is from this boot */
+	kmsg_boot = klog_boot_id();
+	if (store && store->klog_seq && kmsg_boot && (store->klog_boot == kmsg_boot)) {
+		kmsg_seq = store->klog_seq;
+		kmsg_resume = true;
+		lseek(fd, 0, SEEK_SET);
+	} else {
+		lseek(fd, 0, SEEK_DATA);
+	}
+	if (store) {
+		store->klog_seq = 0;
+		store->klog_boot = kmsg_boot;
+	}
+
+	kmsg.fd = fd;
+	uloop_fd_add(&kmsg, ULOOP_READ);
+	kmsg_cb(&kmsg, ULOOP_READ);
+
+	return 0;
+}
+
 static int
 klog_open(void)
 {
 	int fd;
 
+	if (!kmsg_open())
+		return 0;
+
 	fd = open(KLOG_DEFAULT_PROC, O_RDONLY | O_NONBLOCK);
 	if (fd < 0) {
 		fprintf(stderr, "Failed to open %s\n", KLOG_DEFAULT_PROC);
@@ -200,7 +836,7 @@ klog_open(void)
 static int
 syslog_open(void)
 {
-	int fd;
+	int fd, on = 1;
 
 	unlink(log_dev);
 	fd = usock(USOCK_UNIX | USOCK_UDP | USOCK_SERVER | USOCK_NONBLOCK, log_dev, NULL);
@@ -209,80 +845,447 @@ syslog_open(void)
 		return -1;
 	}
 	chmod(log_dev, 0666);
-	ustream_fd_init(&slog, fd);
+	if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)))
+		fprintf(stderr, "Failed to enable drop counting on %s\n", log_dev);
+	slog.fd = fd;
+	uloop_fd_add(&slog, ULOOP_READ);
 	return 0;
 }
 
 struct log_head*
-log_list(int count, struct log_head *h)
+log_find(unsigned int id)
 {
-	unsigned int min = count;
+	unsigned int base = id - (id % LOG_INDEX_STRIDE);
+	struct log_head *h;
 
-	if (count)
-		min = (count < current_id) ? (current_id - count) : (0);
-	if (!h && oldest->id >= min)
+	if ((oldest == newest) || (id >= (unsigned int) current_id))
+		return NULL;
+	if (id <= oldest->id)
 		return oldest;
-	if (!h)
+
+	h = (struct log_head *) ((char *) log + log_index[(base / LOG_INDEX_STRIDE) % log_index_size]);
+	if ((base < oldest->id) || (h->id != base))
 		h = oldest;
 
-	while (h != newest) {
+	while (h->id < id) {
 		h = log_next(h, h->size);
 		if (!h->size && (h > newest))
 			h = log;
-		if (h->id >= min && (h != newest))
-			return h;
 	}
 
-	return NULL;
+	return h;
+}
+
+static struct log_head*
+log_index_get(unsigned int slot)
+{
+	struct log_head *h = (struct log_head *) ((char *) log + log_index[slot % log_index_size]);
+
+	return (h->id == slot * LOG_INDEX_STRIDE) ? (h) : (NULL);
+}
+
+static struct log_head* log_step(struct log_head *h);
+
+/*
+ * First entry logged at or after since, or NULL if there is none. The
+ * ring has to be in time order. Entries may be up to LOG_REORDER_MS older
+ * than the ones before them, so the index is searched for an entry more
+ * than that before since, nothing in front of it can be in range. The
+ * walk from there covers LOG_INDEX_STRIDE entries plus the reorder window,
+ * later entries before since are left to log_filter_match().
+ */
+static struct log_head*
+log_find_time(uint64_t since)
+{
+	uint64_t bound = (since > LOG_REORDER_MS) ? (since - LOG_REORDER_MS) : (0);
+	unsigned int lo, hi, mid;
+	struct log_head *h, *start = oldest;
+
+	lo = (oldest->id + LOG_INDEX_STRIDE - 1) / LOG_INDEX_STRIDE;
+	hi = (current_id - 1) / LOG_INDEX_STRIDE + 1;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		h = log_index_get(mid);
+		if (!h)
+			return oldest;
+		if (log_head_time(h) < bound) {
+			start = h;
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (h = start; h && (log_head_time(h) < since); h = log_step(h))
+		;
+
+	return h;
+}
+
+bool
+log_filter_match(const struct log_filter *f, struct log_head *h)
+{
+	uint64_t t;
+
+	if ((f->priority >= 0) && (LOG_PRI(h->priority) > f->priority))
+		return false;
+	if ((f->source != SOURCE_ANY) && (h->source != f->source))
+		return false;
+	if (f->since || f->until) {
+		t = log_head_time(h);
+		if ((f->since && (t < f->since)) || (f->until && (t > f->until)))
+			return false;
+	}
+	if (f->tag && (f->tag_id ? (h->tag != f->tag_id) :
+	    ((h->tag_len != f->tag_len) || memcmp(h->data, f->tag, h->tag_len))))
+		return false;
+	if (f->match) {
+		struct timespec start;
+		bool ret;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (f->regex)
+			ret = !regexec(&f->pattern, h->data, 0, NULL, 0);
+		else
+			ret = !!strstr(h->data, f->match);
+		log_hist_add(log_stats.filter_time, &start);
+
+		return ret;
+	}
+
+	return true;
+}
+
+static struct log_head*
+log_step(struct log_head *h)
+{
+	h = log_next(h, h->size);
+	if (!h->size && (h > newest))
+		h = log;
+
+	return (h != newest) ? (h) : (NULL);
+}
+
+struct log_head*
+log_list(int count, struct log_head *h, const struct log_filter *f)
+{
+	unsigned int min = count;
+	struct log_head *t;
+
+	if (count)
+		min = (count < current_id) ? (current_id - count) : (0);
+
+	if (!h) {
+		if (f && (f->first_id > min))
+			min = f->first_id;
+		h = log_find(min);
+		if (h && f && f->since && log_sorted()) {
+			t = log_find_time(f->since);
+			if (!t || (t->id > h->id))
+				h = t;
+		}
+	} else if (h != newest) {
+		h = log_step(h);
+	} else {
+		h = NULL;
+	}
+
+	while (h && f && !log_filter_match(f, h)) {
+		/* nothing after this one is in range either */
+		if (f->until && log_sorted() && (log_head_time(h) > f->until + LOG_REORDER_MS))
+			return NULL;
+		h = log_step(h);
+	}
+
+	return h;
+}
+
+/* the live part of the ring as one or two contiguous pieces, oldest first */
+static int
+log_segments(struct iovec *iov)
+{
+	struct log_head *end;
+
+	iov[0].iov_base = oldest;
+	if (oldest <= newest) {
+		iov[0].iov_len = (char *) newest - (char *) oldest;
+		return 1;
+	}
+
+	/* the tail part runs up to the wrap marker or the end of the buffer */
+	for (end = oldest; (end < log_end) && end->size; )
+		end = (struct log_head *) &end->data[PAD(end->size)];
+	iov[0].iov_len = (char *) end - (char *) oldest;
+	iov[1].iov_base = log;
+	iov[1].iov_len = (char *) newest - (char *) log;
+
+	return 2;
+}
+
+void
+log_usage(unsigned int *size, unsigned int *used, unsigned int *messages)
+{
+	struct iovec iov[2];
+	int i, n;
+
+	n = log_segments(iov);
+	for (i = 0, *used = 0; i < n; i++)
+		*used += iov[i].iov_len;
+	*size = log_size;
+	*messages = (oldest != newest) ? (current_id - oldest->id) : (0);
+}
+
+int
+log_snapshot(void)
+{
+	struct log_snapshot hdr = {
+		.magic = LOG_SNAPSHOT_MAGIC,
+		.version = LOG_SNAPSHOT_VERSION,
+		.head_size = sizeof(struct log_head),
+	};
+	struct iovec iov[3];
+	int fd, n, i;
+
+	fd = memfd_create("logd-snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to create snapshot: %s\n", strerror(errno));
+		return -1;
+	}
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	n = log_segments(&iov[1]) + 1;
+	for (i = 1; i < n; i++)
+		hdr.len += iov[i].iov_len;
+
+	if ((writev(fd, iov, n) != sizeof(hdr) + hdr.len) ||
+	    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) ||
+	    (lseek(fd, 0, SEEK_SET) < 0)) {
+		fprintf(stderr, "Failed to write snapshot: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int
+log_index_init(int size)
+{
+	int index_size = size / (sizeof(struct log_head) + 4) / LOG_INDEX_STRIDE + 2;
+	unsigned int *_index = calloc(index_size, sizeof(*_index));
+	struct log_head *l;
+
+	if (!_index)
+		return -1;
+
+	free(log_index);
+	log_index = _index;
+	log_index_size = index_size;
+	log_sorted_id = 0;
+	log_last_time = 0;
+	for (l = log_list(0, NULL, NULL); l; l = log_list(0, l, NULL)) {
+		log_index_add(l);
+		log_order(l);
+	}
+
+	return 0;
 }
 
 int
 log_buffer_init(int size)
 {
-	struct log_head *_log = malloc(size);
+	struct log_head *_log = calloc(1, size);
 
 	if (!_log) {
-		fprintf(stderr, "Failed to initialize log buffer with size %d\n", log_size);
+		fprintf(stderr, "Failed to initialize log buffer with size %d\n", size);
 		return -1;
 	}
 
-	memset(_log, 0, size);
+	free(log);
+	oldest = newest = log = _log;
+	log_end = ((void*) log) + size;
+	log_size = size;
+
+	return log_index_init(size);
+}
+
+static bool
+log_store_valid(int size)
+{
+	unsigned int id, n = 0;
+	struct log_head *h;
+
+	if ((store->magic != LOG_STORE_MAGIC) || (store->version != LOG_STORE_VERSION) ||
+	    (store->size != size) ||
+	    (store->oldest >= size) || (store->newest >= size) ||
+	    (store->oldest % 4) || (store->newest % 4))
+		return false;
 
-	if (log && ((log_size + sizeof(struct log_head)) < size)) {
-		struct log_head *start = _log;
-		struct log_head *end = ((void*) _log) + size;
-		struct log_head *l;
+	oldest = (void *) log + store->oldest;
+	newest = (void *) log + store->newest;
+	current_id = store->current_id;
 
-		l = log_list(0, NULL);
-		while ((start < end) && l && l->size) {
-			memcpy(start, l, PAD(sizeof(struct log_head) + l->size));
-			start = (struct log_head *) &l->data[PAD(l->size)];
-			l = log_list(0, l);
+	for (h = oldest, id = oldest->id; h != newest; ) {
+		if (!h->size) {
+			if (h < newest)
+				return false;
+			h = log;
+			continue;
 		}
-		free(log);
-		newest = start;
-		newest->size = 0;
-		oldest = log = _log;
-		log_end = ((void*) log) + size;
-	} else {
-		oldest = newest = log = _log;
-		log_end = ((void*) log) + size;
+		if (((void *) &h->data[PAD(h->size)] > (void *) log_end) ||
+		    (h->id != id) || h->data[h->size - 1] ||
+		    (h->tag_len > h->msg) || (h->msg >= h->size) ||
+		    (++n > size / sizeof(struct log_head)))
+			return false;
+		/* tag ids are only valid for the lifetime of logd */
+		h->tag = log_tag_intern(h->data, h->tag_len, true);
+		id++;
+		h = log_next(h, h->size);
 	}
+
+	return !n || (id == current_id);
+}
+
+static int
+log_store_init(const char *path, int size)
+{
+	struct log_store *_store;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return -1;
+	}
+
+	if (ftruncate(fd, sizeof(*_store) + size)) {
+		fprintf(stderr, "Failed to resize %s\n", path);
+		close(fd);
+		return -1;
+	}
+
+	_store = mmap(NULL, sizeof(*_store) + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (_store == MAP_FAILED) {
+		fprintf(stderr, "Failed to mmap %s\n", path);
+		return -1;
+	}
+
+	store = _store;
+	log = (struct log_head *) &store[1];
+	log_end = ((void*) log) + size;
 	log_size = size;
 
+	if (log_store_valid(size)) {
+		fprintf(stderr, "log: resuming %d messages from %s\n",
+			current_id - oldest->id, path);
+	} else {
+		memset(log, 0, size);
+		oldest = newest = log;
+		current_id = 0;
+		store->size = size;
+		store->oldest = store->newest = 0;
+		store->current_id = 0;
+		store->klog_seq = 0;
+		store->klog_boot = 0;
+		store->magic = LOG_STORE_MAGIC;
+		store->version = LOG_STORE_VERSION;
+	}
+
+	if (log_index_init(size)) {
+		munmap(store, sizeof(*store) + size);
+		store = NULL;
+		log = NULL;
+		return -1;
+	}
+
 	return 0;
 }
 
+int
+log_resize(int size)
+{
+	struct log_head *_log, *h;
+	struct iovec iov[2];
+	unsigned int len = 0, rec;
+	int id = current_id;
+	int n, i;
+
+	size = PAD(size);
+	if (size == log_size)
+		return 0;
+
+	_log = calloc(1, size);
+	if (!_log) {
+		fprintf(stderr, "Failed to allocate log buffer with size %d\n", size);
+		return -1;
+	}
+
+	n = log_segments(iov);
+	for (i = 0; i < n; i++)
+		len += iov[i].iov_len;
+
+	/* drop the oldest messages if they no longer fit */
+	for (i = 0; (i < n) && (len + sizeof(struct log_head) > size); ) {
+		if (!iov[i].iov_len) {
+			i++;
+			continue;
+		}
+		h = iov[i].iov_base;
+		rec = (char *) &h->data[PAD(h->size)] - (char *) h;
+		iov[i].iov_base += rec;
+		iov[i].iov_len -= rec;
+		len -= rec;
+	}
+
+	for (i = 0, h = _log; i < n; i++) {
+		memcpy(h, iov[i].iov_base, iov[i].iov_len);
+		h = (void *) h + iov[i].iov_len;
+	}
+
+	if (store) {
+		munmap(store, sizeof(*store) + log_size);
+		store = NULL;
+		log = NULL;
+		if (!log_store_init(store_path, size)) {
+			memcpy(log, _log, len);
+			free(_log);
+			_log = log;
+		} else {
+			fprintf(stderr, "Failed to map %s, using volatile memory\n", store_path);
+		}
+	} else {
+		free(log);
+	}
+
+	log = oldest = _log;
+	log_end = ((void*) log) + size;
+	newest = ((void*) log) + len;
+	log_size = size;
+	current_id = id;
+	if (store) {
+		store->oldest = 0;
+		store->newest = len;
+		store->current_id = current_id;
+		store->klog_seq = kmsg_resume ? (kmsg_seq) : (0);
+		store->klog_boot = kmsg_boot;
+	}
+
+	return log_index_init(size);
+}
+
 void
-log_init(int _log_size)
+log_init(int _log_size, const char *_store_path)
 {
 	if (_log_size > 0)
 		log_size = _log_size;
 
-	regcomp(&pat_prio, "^<([0-9]*)>(.*)", REG_EXTENDED);
-	regcomp(&pat_tstamp, "^\[[ 0]*([0-9]*).([0-9]*)] (.*)", REG_EXTENDED);
+	store_path = _store_path;
+	if (store_path && log_store_init(store_path, log_size))
+		fprintf(stderr, "Failed to map %s, using volatile memory\n", store_path);
 
-	if (log_buffer_init(log_size)) {
+	if (!log && log_buffer_init(log_size)) {
 		fprintf(stderr, "Failed to allocate log memory\n");
 		exit(-1);
 	}
@@ -295,11 +1298,18 @@ log_init(int _log_size)
 void
 log_shutdown(void)
 {
-	ustream_free(&slog.stream);
-	ustream_free(&klog.stream);
-	close(slog.fd.fd);
-	close(klog.fd.fd);
-	free(log);
-	regfree(&pat_prio);
-	regfree(&pat_tstamp);
+	uloop_fd_delete(&slog);
+	close(slog.fd);
+	if (kmsg.fd >= 0) {
+		uloop_fd_delete(&kmsg);
+		close(kmsg.fd);
+	} else {
+		ustream_free(&klog.stream);
+		close(klog.fd.fd);
+	}
+	if (store)
+		munmap(store, sizeof(*store) + log_size);
+	else
+		free(log);
+	free(log_index);
 }
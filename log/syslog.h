@@ -14,6 +14,10 @@
 #ifndef __SYSLOG_H
 #define __SYSLOG_H
 
+#include <regex.h>
+#include <stdbool.h>
+#include <stdint.h>
+
 enum {
 	SOURCE_KLOG = 0,
 	SOURCE_SYSLOG = 1,
@@ -27,15 +31,80 @@ struct log_head {
 	int priority;
 	int source;
 	struct timespec ts;
+	int pid;		/* 0 if the message carries none */
+	unsigned short tag;	/* interned tag, 0 if none or not interned */
+	unsigned char tag_len;	/* the tag is the first tag_len bytes of data */
+	unsigned char msg;	/* offset of the text after "tag[pid]: " */
 	char data[];
 };
 
-void log_init(int log_size);
+#define PAD(x) (x % 4) ? (((x) - (x % 4)) + 4) : (x)
+
+#define LOG_SNAPSHOT_MAGIC	0x6c6f6773
+#define LOG_SNAPSHOT_VERSION	2
+
+/* header of a snapshot, followed by len bytes of log_head records */
+struct log_snapshot {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t head_size;	/* sizeof(struct log_head) of the writer */
+	uint32_t len;
+};
+
+struct log_filter {
+	unsigned int first_id;	/* lowest id to return */
+	int priority;		/* highest severity to return, -1 for any */
+	int source;		/* SOURCE_* or SOURCE_ANY */
+	uint64_t since;		/* time range in ms, 0 for unbounded */
+	uint64_t until;
+	char *tag;		/* exact tag, NULL for any */
+	size_t tag_len;
+	unsigned short tag_id;	/* interned tag, 0 if not known yet */
+	char *match;		/* substring, or pattern if regex is set */
+	bool regex;
+	regex_t pattern;
+};
+
+/* buckets of the time histograms, <1us, <4us, <16us, ... */
+#define LOG_HIST_BUCKETS	8
+
+struct log_counter {
+	unsigned int messages;
+	uint64_t bytes;
+};
+
+struct log_stats {
+	unsigned int dropped;	/* datagrams dropped by the kernel on the syslog socket */
+	unsigned int limited;	/* messages over the rate limit */
+	unsigned int repeated;	/* messages coalesced into "repeated N times" */
+	unsigned int kernel_dropped;	/* /dev/kmsg records lost before we read them */
+	struct log_counter ingest[SOURCE_INTERNAL + 1];
+	struct log_counter evicted;	/* overwritten by newer messages */
+	unsigned int ingest_time[LOG_HIST_BUCKETS];	/* per log_add() */
+	unsigned int filter_time[LOG_HIST_BUCKETS];	/* per match or regex test */
+};
+
+struct log_limits {
+	unsigned int rate;	/* messages per second per source and tag, 0 for no limit */
+	unsigned int burst;	/* messages allowed in a row */
+	bool dedup;		/* coalesce repeated messages */
+};
+
+extern struct log_stats log_stats;
+extern struct log_limits log_limits;
+
+void log_init(int log_size, const char *store_path);
 void log_shutdown(void);
 
 typedef void (*log_list_cb)(struct log_head *h);
-struct log_head* log_list(int count, struct log_head *h);
+bool log_filter_match(const struct log_filter *f, struct log_head *h);
+struct log_head* log_list(int count, struct log_head *h, const struct log_filter *f);
+struct log_head* log_find(unsigned int id);
+unsigned short log_tag_intern(const char *tag, int len, bool add);
+int log_snapshot(void);
+void log_usage(unsigned int *size, unsigned int *used, unsigned int *messages);
 int log_buffer_init(int size);
+int log_resize(int size);
 void log_add(char *buf, int size, int source);
 void ubus_notify_log(struct log_head *l);
 
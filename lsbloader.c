@@ -19,15 +19,22 @@
 #include <stdlib.h>
 #define __USE_GNU
 #include <string.h>
-#include <regex.h>
 #include <glob.h>
 
 #include <libubox/list.h>
+#include <libubox/uloop.h>
 #include <libubox/blobmsg_json.h>
 #include "libubus.h"
 
+enum {
+	INITD_NEW,
+	INITD_PENDING,
+	INITD_DONE,
+};
+
 struct initd {
 	struct list_head list;
+	struct ubus_request req;
 
 	char *name;
 	char *exec;
@@ -36,16 +43,23 @@ struct initd {
 	char **deps;
 	int start;
 	int stop;
+	int state;
 };
 
+#define LSB_ALNUM	"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+
 static LIST_HEAD(initds);
-static regex_t pat_provides, pat_require, pat_start, pat_stop, pat_desc, pat_exec, pat_tpl;
 static struct ubus_context *ctx;
 static struct blob_buf b;
 static uint32_t service;
+static struct uloop_timeout timeout;
+static int pending;
+static bool force;
 
 static void initd_free(struct initd *i)
 {
+	char **d;
+
 	if (i->name)
 		free(i->name);
 	if (i->exec)
@@ -54,49 +68,88 @@ static void initd_free(struct initd *i)
 		free(i->desc);
 	if (i->tpl)
 		free(i->tpl);
+	if (i->deps) {
+		for (d = i->deps; *d; d++)
+			free(*d);
+		free(i->deps);
+	}
+	free(i);
+}
+
+/* the leading characters of value, after blanks, that are in accept */
+static char *initd_value(const char *value, const char *accept)
+{
+	size_t len;
+
+	value += strspn(value, " \t");
+	len = strspn(value, accept);
+
+	return len ? strndup(value, len) : NULL;
+}
+
+static char **initd_deps(const char *value)
+{
+	char *deps, *t, **d;
+	int n = 0;
+
+	deps = initd_value(value, LSB_ALNUM " ");
+	if (!deps)
+		return NULL;
+
+	d = calloc(strlen(deps) / 2 + 2, sizeof(*d));
+	if (d)
+		for (t = strtok(deps, " "); t; t = strtok(NULL, " "))
+			d[n++] = strdup(t);
+	free(deps);
+
+	return d;
 }
 
 static int initd_parse(const char *file)
 {
 	FILE *fp;
 	struct initd *i;
-	regmatch_t matches[2];
-	char buffer[1024];
-	ssize_t len;
+	char line[256], *p;
 
 	fp = fopen(file, "r");
 	if (!fp) {
 		fprintf(stderr, "failed to open %s\n", file);
 		return -1;
 	}
-	len = fread(buffer, 1, sizeof(buffer) - 1, fp);
-	fclose(fp);
-
-	if (len < 1) {
-		fprintf(stderr, "failed to read from %s\n", file);
-		return -1;
-	}
-	buffer[len] = '\0';
 
-	i = malloc(sizeof(struct initd));
+	i = calloc(1, sizeof(struct initd));
 	if (!i) {
 		fprintf(stderr, "failed to alloc initd struct\n");
+		fclose(fp);
 		return -1;
 	}
-	memset(i, 0, sizeof(*i));
-
-	if (!regexec(&pat_provides, buffer, 2, matches, 0))
-		i->name = strndup(buffer + matches[1].rm_so, (size_t)matches[1].rm_eo - matches[1].rm_so);
-	if (!regexec(&pat_exec, buffer, 2, matches, 0))
-		i->exec = strndup(buffer + matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so);
-	if (!regexec(&pat_desc, buffer, 2, matches, 0))
-		i->desc = strndup(buffer + matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so);
-	if (!regexec(&pat_tpl, buffer, 2, matches, 0))
-		i->tpl = strndup(buffer + matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so);
-	if (!regexec(&pat_start, buffer, 2, matches, 0))
-		i->start += atoi(buffer + matches[1].rm_so);
-	if (!regexec(&pat_stop, buffer, 2, matches, 0))
-		i->stop += atoi(buffer + matches[1].rm_so);
+
+	/* a single pass over the header, the first occurrence of a key wins */
+	while (fgets(line, sizeof(line), fp)) {
+		if (strstr(line, "END INIT INFO"))
+			break;
+
+		p = strstr(line, "# ");
+		if (!p)
+			continue;
+		p += 2;
+
+		if (!strncmp(p, "Provides:", 9) && !i->name)
+			i->name = initd_value(p + 9, LSB_ALNUM);
+		else if (!strncmp(p, "Required-Start:", 15) && !i->deps)
+			i->deps = initd_deps(p + 15);
+		else if (!strncmp(p, "Default-Start:", 14) && !i->start)
+			i->start = atoi(p + 14 + strspn(p + 14, " \t"));
+		else if (!strncmp(p, "Default-Stop:", 13) && !i->stop)
+			i->stop = atoi(p + 13 + strspn(p + 13, " \t"));
+		else if (!strncmp(p, "Description:", 12) && !i->desc)
+			i->desc = initd_value(p + 12, LSB_ALNUM " ");
+		else if (!strncmp(p, "X-Exec:", 7) && !i->exec)
+			i->exec = initd_value(p + 7, LSB_ALNUM "/ ");
+		else if (!strncmp(p, "X-Template:", 11) && !i->tpl)
+			i->tpl = initd_value(p + 11, LSB_ALNUM "/.");
+	}
+	fclose(fp);
 
 	if (i->name && i->exec)
 		list_add(&i->list, &initds);
@@ -111,54 +164,143 @@ static void initd_init(void)
 	int gl_flags = GLOB_NOESCAPE | GLOB_MARK;
 	glob_t gl;
 
-	regcomp(&pat_provides, "# Provides:[ \t]*([a-zA-Z0-9]+)", REG_EXTENDED);
-	regcomp(&pat_require, "# Required-Start:[ \t]*([a-zA-Z0-9 ]+)", REG_EXTENDED);
-	regcomp(&pat_start, "# Default-Start:[ \t]*([0-9])", REG_EXTENDED);
-	regcomp(&pat_stop, "# Default-Stop:[ \t]*([0-9])", REG_EXTENDED);
-	regcomp(&pat_desc, "# Description:[ \t]*([a-zA-Z0-9 ]+)", REG_EXTENDED);
-	regcomp(&pat_exec, "# X-Exec:[ \t]*([a-zA-Z0-9/ ]+)", REG_EXTENDED);
-	regcomp(&pat_tpl, "# X-Template:[ \t]*([a-zA-Z0-9/.]+)", REG_EXTENDED);
-
 	if (glob("/etc/rc.d/P*", gl_flags, NULL, &gl) >= 0) {
 		int j;
 		for (j = 0; j < gl.gl_pathc; j++)
 			initd_parse(gl.gl_pathv[j]);
 	}
 	globfree(&gl);
-
-	regfree(&pat_provides);
-	regfree(&pat_require);
-	regfree(&pat_start);
-	regfree(&pat_stop);
-	regfree(&pat_desc);
-	regfree(&pat_exec);
-	regfree(&pat_tpl);
 }
 
-static int init_services(void)
+static struct initd *initd_find(const char *name)
 {
 	struct initd *i;
+
+	list_for_each_entry(i, &initds, list)
+		if (!strcmp(i->name, name))
+			return i;
+
+	return NULL;
+}
+
+/* services listed in Required-Start have to be added first */
+static bool initd_ready(struct initd *i)
+{
+	struct initd *dep;
+	char **d;
+
+	if (force || !i->deps)
+		return true;
+
+	for (d = i->deps; *d; d++) {
+		dep = initd_find(*d);
+		if (dep && (dep != i) && (dep->state != INITD_DONE))
+			return false;
+	}
+
+	return true;
+}
+
+static void init_next(void);
+
+static void init_complete(struct ubus_request *req, int ret)
+{
+	struct initd *i = container_of(req, struct initd, req);
+
+	if (ret)
+		fprintf(stderr, "Failed to add service %s: %s\n", i->name, ubus_strerror(ret));
+
+	i->state = INITD_DONE;
+	pending--;
+	init_next();
+}
+
+static void init_add(struct initd *i)
+{
 	void *instances, *instance, *command;
+	char *t;
+	int ret;
+
+	blob_buf_init(&b, 0);
+	blobmsg_add_string(&b, "name", i->name);
+	instances = blobmsg_open_table(&b, "instances");
+	instance = blobmsg_open_table(&b, "instance");
+	command = blobmsg_open_array(&b, "command");
+	t = strtok(i->exec, " ");
+	while (t) {
+		blobmsg_add_string(&b, NULL, t);
+		t = strtok(NULL, " ");
+	}
+	blobmsg_close_array(&b, command);
+	blobmsg_close_table(&b, instance);
+	blobmsg_close_table(&b, instances);
+
+	ret = ubus_invoke_async(ctx, service, "add", b.head, &i->req);
+	if (ret) {
+		fprintf(stderr, "Failed to add service %s: %s\n", i->name, ubus_strerror(ret));
+		i->state = INITD_DONE;
+		return;
+	}
+
+	i->req.complete_cb = init_complete;
+	ubus_complete_request_async(ctx, &i->req);
+	i->state = INITD_PENDING;
+	pending++;
+}
 
-	list_for_each_entry(i, &initds, list) {
-		char *t;
-
-		blob_buf_init(&b, 0);
-		blobmsg_add_string(&b, "name", i->name);
-		instances = blobmsg_open_table(&b, "instances");
-		instance = blobmsg_open_table(&b, "instance");
-		command = blobmsg_open_array(&b, "command");
-		t = strtok(i->exec, " ");
-		while (t) {
-			blobmsg_add_string(&b, NULL, t);
-			t = strtok(NULL, " ");
+/*
+ * Send an add request for every service whose dependencies have been
+ * added, without waiting for the replies of the others.
+ */
+static void init_next(void)
+{
+	struct initd *i;
+	bool sent, blocked;
+
+	do {
+		sent = blocked = false;
+		list_for_each_entry(i, &initds, list) {
+			if (i->state != INITD_NEW)
+				continue;
+			if (!initd_ready(i)) {
+				blocked = true;
+				continue;
+			}
+			init_add(i);
+			sent = true;
 		}
-		blobmsg_close_array(&b, command);
-		blobmsg_close_table(&b, instance);
-		blobmsg_close_table(&b, instances);
-		ubus_invoke(ctx, service, "add", b.head, NULL, 0, 1000);
+	} while (sent && !pending);
+
+	if (pending) {
+		uloop_timeout_set(&timeout, 1000);
+		return;
+	}
+
+	if (blocked) {
+		fprintf(stderr, "Dependency loop in Required-Start, adding the remaining services\n");
+		force = true;
+		init_next();
+		return;
 	}
 
+	uloop_timeout_cancel(&timeout);
+	uloop_end();
+}
+
+static void init_timeout(struct uloop_timeout *t)
+{
+	fprintf(stderr, "Timed out waiting for %d service%s to be added\n",
+		pending, (pending == 1) ? "" : "s");
+	uloop_end();
+}
+
+static int init_services(void)
+{
+	timeout.cb = init_timeout;
+	init_next();
+	if (pending)
+		uloop_run();
+
 	return 0;
 }
 
@@ -183,5 +325,10 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	return init_services();
+	uloop_init();
+	ubus_add_uloop(ctx);
+	ret = init_services();
+	uloop_done();
+
+	return ret;
 }
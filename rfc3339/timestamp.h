@@ -40,9 +40,20 @@ typedef struct {
     int16_t offset; /* Offset from UTC in minutes [-1439, 1439] */
 } timestamp_t;
 
+typedef struct {
+    int64_t  sec;       /* Second of the cached string */
+    uint32_t rdn;       /* Day of the cached string */
+    int16_t  offset;
+    int      precision;
+    size_t   len;       /* Length of str, 0 while the cache is empty */
+    char     str[36];
+} timestamp_cache_t;
+
 int         timestamp_parse            (const char *str, size_t len, timestamp_t *tsp);
 size_t      timestamp_format           (char *dst, size_t len, const timestamp_t *tsp);
 size_t      timestamp_format_precision (char *dst, size_t len, const timestamp_t *tsp, int precision);
+size_t      timestamp_format_cached    (timestamp_cache_t *cache, char *dst, size_t len, const timestamp_t *tsp, int precision);
+size_t      timestamp_format_ctime     (char *dst, size_t len, const timestamp_t *tsp);
 int         timestamp_compare          (const timestamp_t *tsp1, const timestamp_t *tsp2);
 bool        timestamp_valid            (const timestamp_t *tsp);
 struct tm * timestamp_to_tm_utc        (const timestamp_t *tsp, struct tm *tmp);
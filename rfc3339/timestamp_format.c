@@ -24,6 +24,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <stddef.h>
+#include <string.h>
 #include "timestamp.h"
 
 static const uint16_t DayOffset[13] = {
@@ -58,6 +59,39 @@ static const uint32_t Pow10[10] = {
     1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
 };
 
+/* hh:mm:ss at p[11..18] */
+static void
+format_time(unsigned char *p, uint32_t v) {
+    p[18] = '0' + (v % 10); v /= 10;
+    p[17] = '0' + (v %  6); v /=  6;
+    p[16] = ':';
+    p[15] = '0' + (v % 10); v /= 10;
+    p[14] = '0' + (v %  6); v /=  6;
+    p[13] = ':';
+    p[12] = '0' + (v % 10); v /= 10;
+    p[11] = '0' + (v % 10);
+}
+
+/* .fff at p[0..precision] */
+static void
+format_fraction(unsigned char *p, int32_t nsec, const int precision) {
+    uint32_t v;
+
+    v = nsec / Pow10[9 - precision];
+    switch (precision) {
+        case 9: p[9] = '0' + (v % 10); v /= 10;
+        case 8: p[8] = '0' + (v % 10); v /= 10;
+        case 7: p[7] = '0' + (v % 10); v /= 10;
+        case 6: p[6] = '0' + (v % 10); v /= 10;
+        case 5: p[5] = '0' + (v % 10); v /= 10;
+        case 4: p[4] = '0' + (v % 10); v /= 10;
+        case 3: p[3] = '0' + (v % 10); v /= 10;
+        case 2: p[2] = '0' + (v % 10); v /= 10;
+        case 1: p[1] = '0' + (v % 10);
+    }
+    p[0] = '.';
+}
+
 static size_t
 timestamp_format_internal(char *dst, size_t len, const timestamp_t *tsp, const int precision) {
     unsigned char *p;
@@ -87,15 +121,7 @@ timestamp_format_internal(char *dst, size_t len, const timestamp_t *tsp, const i
     * YYYY-MM-DDThh:mm:ss
     */
     p = (unsigned char *)dst;
-    v = sec % 86400;
-    p[18] = '0' + (v % 10); v /= 10;
-    p[17] = '0' + (v %  6); v /=  6;
-    p[16] = ':';
-    p[15] = '0' + (v % 10); v /= 10;
-    p[14] = '0' + (v %  6); v /=  6;
-    p[13] = ':';
-    p[12] = '0' + (v % 10); v /= 10;
-    p[11] = '0' + (v % 10);
+    format_time(p, sec % 86400);
     p[10] = 'T';
     p[ 9] = '0' + (d % 10); d /= 10;
     p[ 8] = '0' + (d % 10);
@@ -110,19 +136,7 @@ timestamp_format_internal(char *dst, size_t len, const timestamp_t *tsp, const i
     p += 19;
 
     if (precision) {
-        v = tsp->nsec / Pow10[9 - precision];
-        switch (precision) {
-            case 9: p[9] = '0' + (v % 10); v /= 10;
-            case 8: p[8] = '0' + (v % 10); v /= 10;
-            case 7: p[7] = '0' + (v % 10); v /= 10;
-            case 6: p[6] = '0' + (v % 10); v /= 10;
-            case 5: p[5] = '0' + (v % 10); v /= 10;
-            case 4: p[4] = '0' + (v % 10); v /= 10;
-            case 3: p[3] = '0' + (v % 10); v /= 10;
-            case 2: p[2] = '0' + (v % 10); v /= 10;
-            case 1: p[1] = '0' + (v % 10);
-        }
-        p[0] = '.';
+        format_fraction(p, tsp->nsec, precision);
         p += 1 + precision;
     }
 
@@ -184,3 +198,42 @@ timestamp_format_precision(char *dst, size_t len, const timestamp_t *tsp, int pr
     return timestamp_format_internal(dst, len, tsp, precision);
 }
 
+
+/*
+ * Same output as timestamp_format_precision(), but the date and time of
+ * day are kept in the cache so that consecutive timestamps of the same
+ * second only rewrite the fraction, and those of the same day only the
+ * time of day.
+ */
+
+size_t
+timestamp_format_cached(timestamp_cache_t *cache, char *dst, size_t len, const timestamp_t *tsp, int precision) {
+    uint64_t sec;
+    uint32_t rdn;
+
+    if (!timestamp_valid(tsp) || precision < 0 || precision > 9)
+        return 0;
+
+    sec = tsp->sec + tsp->offset * 60 + EPOCH;
+    rdn = sec / 86400;
+
+    if (!cache->len || cache->offset != tsp->offset || cache->precision != precision || cache->rdn != rdn) {
+        cache->len = timestamp_format_internal(cache->str, sizeof(cache->str), tsp, precision);
+        cache->sec = tsp->sec;
+        cache->rdn = rdn;
+        cache->offset = tsp->offset;
+        cache->precision = precision;
+    } else if (cache->sec != tsp->sec) {
+        format_time((unsigned char *)cache->str, sec % 86400);
+        cache->sec = tsp->sec;
+    }
+
+    if (precision)
+        format_fraction((unsigned char *)cache->str + 19, tsp->nsec, precision);
+
+    if (cache->len >= len)
+        return 0;
+
+    memcpy(dst, cache->str, cache->len + 1);
+    return cache->len;
+}
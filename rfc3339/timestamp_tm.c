@@ -24,6 +24,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <stddef.h>
+#include <string.h>
 #include <time.h>
 #include "timestamp.h"
 
@@ -90,3 +91,61 @@ timestamp_to_tm_utc(const timestamp_t *tsp, struct tm *tmp) {
     return timestamp_to_tm(tsp, tmp, false);
 }
 
+
+static const char DayNames[7][4] = {
+    "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+
+static const char MonthNames[12][4] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+/*
+ * ctime(3) layout of the local time of tsp, without the trailing newline
+ * and without touching the libc timezone state.
+ *
+ *           1         2
+ * 0123456789012345678901234
+ * Www Mmm dd hh:mm:ss yyyy
+ */
+
+size_t
+timestamp_format_ctime(char *dst, size_t len, const timestamp_t *tsp) {
+    struct tm tm;
+    char *p = dst;
+    int y;
+
+    if (!timestamp_to_tm_local(tsp, &tm))
+        return 0;
+
+    y = tm.tm_year + 1900;
+    if (len < sizeof("Www Mmm dd hh:mm:ss yyyy"))
+        return 0;
+
+    memcpy(p, DayNames[tm.tm_wday], 3);
+    p[3] = ' ';
+    memcpy(p + 4, MonthNames[tm.tm_mon], 3);
+    p[7] = ' ';
+    p[8] = (tm.tm_mday < 10) ? ' ' : '0' + tm.tm_mday / 10;
+    p[9] = '0' + tm.tm_mday % 10;
+    p[10] = ' ';
+    p[11] = '0' + tm.tm_hour / 10;
+    p[12] = '0' + tm.tm_hour % 10;
+    p[13] = ':';
+    p[14] = '0' + tm.tm_min / 10;
+    p[15] = '0' + tm.tm_min % 10;
+    p[16] = ':';
+    p[17] = '0' + tm.tm_sec / 10;
+    p[18] = '0' + tm.tm_sec % 10;
+    p[19] = ' ';
+    p += 20;
+
+    if (y >= 1000) *p++ = '0' + y / 1000;
+    if (y >=  100) *p++ = '0' + y / 100 % 10;
+    if (y >=   10) *p++ = '0' + y / 10 % 10;
+    *p++ = '0' + y % 10;
+    *p = 0;
+
+    return p - dst;
+}
@@ -3,20 +3,39 @@
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <math.h>
 
 #include <arpa/inet.h>
 #include <netinet/ether.h>
 #include <sys/stat.h>
 
+#include <libubox/blobmsg_json.h>
 #include <uci.h>
 
 #include "libvalidate.h"
 
+/* a compiled 'option:datatype:default' tuple from a batch schema */
+struct batch_option {
+	char *tuple;
+	char *name, *expr, *def;
+	struct dt_code *code;
+	bool invalid;
+};
+
+struct batch_type {
+	const char *name;
+	int noptions;
+	struct batch_option *options;
+};
+
+static struct blob_buf schema, out;
+
 static void
 print_usage(char *argv)
 {
 	fprintf(stderr, "%s <datatype> <value>\t- validate a value against a type\n", argv);
 	fprintf(stderr, "%s <package> <section_type> <section_name> 'option:datatype:default' 'option:datatype:default' ...\n", argv);
+	fprintf(stderr, "%s -s <schema.json>\t- validate all sections listed in a schema, output JSON\n", argv);
 }
 
 static const char *
@@ -113,6 +132,7 @@ validate_value(struct uci_ptr *ptr, const char *expr, const char *def)
 	enum dt_type type = DT_INVALID;
 	struct uci_element *e;
 	struct uci_option *opt = NULL;
+	struct dt_code *code = dt_compile(expr);
 
 	if ((ptr->flags & UCI_LOOKUP_COMPLETE) &&
 	    (ptr->last->type == UCI_TYPE_OPTION))
@@ -131,7 +151,7 @@ validate_value(struct uci_ptr *ptr, const char *expr, const char *def)
 				printf("\\ ");
 
 			empty = false;
-			type = dt_parse(expr, e->name);
+			type = code ? dt_check(code, e->name) : DT_INVALID;
 
 			if (type != DT_INVALID)
 				escape_value(type, e->name);
@@ -147,7 +167,7 @@ validate_value(struct uci_ptr *ptr, const char *expr, const char *def)
 	else if (opt && opt->v.string && *opt->v.string)
 	{
 		empty = false;
-		type = dt_parse(expr, opt->v.string);
+		type = code ? dt_check(code, opt->v.string) : DT_INVALID;
 		export_value(type, ptr->option, opt->v.string);
 
 		fprintf(stderr, "%s.%s.%s=%s validates as %s with %s\n",
@@ -157,7 +177,7 @@ validate_value(struct uci_ptr *ptr, const char *expr, const char *def)
 
 	if (empty)
 	{
-		type = dt_parse(expr, def);
+		type = code ? dt_check(code, def) : DT_INVALID;
 
 		if (type == DT_INVALID)
 			type = DT_STRING;
@@ -168,6 +188,9 @@ validate_value(struct uci_ptr *ptr, const char *expr, const char *def)
 				ptr->package, ptr->section, ptr->option, expr, def);
 	}
 
+	if (code)
+		dt_free(code);
+
 	return type ? 0 : -1;
 }
 
@@ -192,6 +215,298 @@ validate_option(struct uci_context *ctx, char *package, char *section, char *opt
 	return validate_value(&ptr, expr, def);
 }
 
+static void
+batch_add_value(enum dt_type type, const char *name, const char *val)
+{
+	double d;
+	char *e;
+
+	switch (type)
+	{
+	case DT_BOOL:
+		blobmsg_add_u8(&out, name, !strcmp(bool_to_num(val), "1"));
+		break;
+
+	case DT_NUMBER:
+		d = strtod(val, &e);
+
+		/*
+		 * inf, nan and doubles outside of int64_t can neither be cast
+		 * nor printed as JSON numbers, keep them as strings
+		 */
+		if (*e || !isfinite(d) || (fabs(d) >= 0x1p63))
+			blobmsg_add_string(&out, name, val);
+		else if (d == (int64_t) d)
+			blobmsg_add_u64(&out, name, (int64_t) d);
+		else
+			blobmsg_add_double(&out, name, d);
+		break;
+
+	default:
+		blobmsg_add_string(&out, name, val);
+		break;
+	}
+}
+
+static bool
+batch_validate(struct uci_context *ctx, struct uci_section *s,
+               struct batch_option *o)
+{
+	enum dt_type type = DT_INVALID, *types;
+	bool valid = true;
+	int n = 0;
+	struct uci_element *e;
+	struct uci_option *opt = NULL;
+	struct uci_ptr ptr = {
+		.package = s->package->e.name,
+		.section = s->e.name,
+		.option = o->name
+	};
+	void *c;
+
+	if (!uci_lookup_ptr(ctx, &ptr, NULL, false) &&
+	    (ptr.flags & UCI_LOOKUP_COMPLETE) &&
+	    (ptr.last->type == UCI_TYPE_OPTION))
+		opt = ptr.o;
+
+	if (opt && opt->type == UCI_TYPE_LIST)
+	{
+		uci_foreach_element(&opt->v.list, e)
+			n++;
+
+		types = calloc(n + 1, sizeof(*types));
+		if (!types)
+			return false;
+
+		/* like a single option, a list with an invalid entry is left out */
+		n = 0;
+		uci_foreach_element(&opt->v.list, e)
+		{
+			if (!e->name || !*e->name)
+				continue;
+
+			types[n] = o->code ? dt_check(o->code, e->name) : DT_INVALID;
+
+			if (types[n++] == DT_INVALID)
+			{
+				fprintf(stderr, "%s.%s.%s=%s does not validate as %s\n",
+				        ptr.package, ptr.section, o->name, e->name, o->expr);
+				valid = false;
+			}
+		}
+
+		if (valid)
+		{
+			c = blobmsg_open_array(&out, o->name);
+
+			n = 0;
+			uci_foreach_element(&opt->v.list, e)
+				if (e->name && *e->name)
+					batch_add_value(types[n++], NULL, e->name);
+
+			blobmsg_close_array(&out, c);
+		}
+
+		free(types);
+
+		return valid;
+	}
+	else if (opt && opt->v.string && *opt->v.string)
+	{
+		type = o->code ? dt_check(o->code, opt->v.string) : DT_INVALID;
+
+		if (type != DT_INVALID)
+			batch_add_value(type, o->name, opt->v.string);
+		else
+			fprintf(stderr, "%s.%s.%s=%s does not validate as %s\n",
+			        ptr.package, ptr.section, o->name, opt->v.string, o->expr);
+
+		return (type != DT_INVALID);
+	}
+	else
+	{
+		if (!o->def || !*o->def)
+			return true;
+
+		type = o->code ? dt_check(o->code, o->def) : DT_INVALID;
+		batch_add_value(type ? type : DT_STRING, o->name, o->def);
+
+		return true;
+	}
+}
+
+static int
+batch_compile(struct blob_attr *pkg, struct batch_type *types)
+{
+	struct blob_attr *type, *tuple;
+	struct batch_option *o;
+	int n = 0, rem, trem;
+
+	blobmsg_for_each_attr(type, pkg, rem)
+	{
+		if (blobmsg_type(type) != BLOBMSG_TYPE_ARRAY)
+			continue;
+
+		types[n].name = blobmsg_name(type);
+		types[n].options = calloc(blobmsg_data_len(type) / sizeof(struct blob_attr) + 1,
+		                          sizeof(*types[n].options));
+
+		if (!types[n].options)
+			return -1;
+
+		blobmsg_for_each_attr(tuple, type, trem)
+		{
+			if (blobmsg_type(tuple) != BLOBMSG_TYPE_STRING)
+				continue;
+
+			o = &types[n].options[types[n].noptions];
+			o->tuple = strdup(blobmsg_get_string(tuple));
+
+			if (!o->tuple)
+				return -1;
+
+			if (!parse_tuple(o->tuple, &o->name, &o->expr, &o->def))
+			{
+				fprintf(stderr, "%s is not a valid option\n", blobmsg_get_string(tuple));
+				free(o->tuple);
+				continue;
+			}
+
+			o->code = dt_compile(o->expr);
+			types[n].noptions++;
+		}
+
+		n++;
+	}
+
+	return n;
+}
+
+static void
+batch_free(struct batch_type *types)
+{
+	int i, j;
+
+	for (i = 0; types[i].options; i++)
+	{
+		for (j = 0; j < types[i].noptions; j++)
+		{
+			if (types[i].options[j].code)
+				dt_free(types[i].options[j].code);
+
+			free(types[i].options[j].tuple);
+		}
+
+		free(types[i].options);
+	}
+
+	free(types);
+}
+
+/*
+ * Validate every section of the packages listed in a JSON schema of the
+ * form { "package": { "section_type": [ "option:datatype:default", ... ] } }
+ * and print the valid values of all sections as one JSON document.
+ */
+static int
+validate_batch(const char *file)
+{
+	struct uci_context *ctx;
+	struct uci_package *p;
+	struct uci_element *e;
+	struct uci_section *s;
+	struct batch_type *types;
+	struct blob_attr *pkg;
+	void *c, *sc, *ic;
+	int i, j, ntypes, rem, rc = 0;
+	char *json;
+
+	blob_buf_init(&schema, 0);
+
+	if (!blobmsg_add_json_from_file(&schema, file))
+	{
+		fprintf(stderr, "failed to parse schema %s\n", file);
+		return -1;
+	}
+
+	ctx = uci_alloc_context();
+
+	if (!ctx)
+		return -1;
+
+	blob_buf_init(&out, 0);
+
+	blob_for_each_attr(pkg, schema.head, rem)
+	{
+		if (blobmsg_type(pkg) != BLOBMSG_TYPE_TABLE)
+			continue;
+
+		types = calloc(blobmsg_data_len(pkg) / sizeof(struct blob_attr) + 1, sizeof(*types));
+		ntypes = types ? batch_compile(pkg, types) : -1;
+
+		if (ntypes < 0 || uci_load(ctx, blobmsg_name(pkg), &p))
+		{
+			fprintf(stderr, "failed to load package %s\n", blobmsg_name(pkg));
+
+			if (types)
+				batch_free(types);
+
+			rc = -1;
+			continue;
+		}
+
+		c = blobmsg_open_table(&out, blobmsg_name(pkg));
+
+		uci_foreach_element(&p->sections, e)
+		{
+			s = uci_to_section(e);
+
+			for (i = 0; i < ntypes; i++)
+				if (!strcmp(types[i].name, s->type))
+					break;
+
+			if (i == ntypes)
+				continue;
+
+			sc = blobmsg_open_table(&out, e->name);
+			blobmsg_add_string(&out, ".type", s->type);
+
+			for (j = 0; j < types[i].noptions; j++)
+			{
+				types[i].options[j].invalid =
+					!batch_validate(ctx, s, &types[i].options[j]);
+
+				if (types[i].options[j].invalid)
+					rc = -1;
+			}
+
+			/* names of the options that are set but did not validate */
+			ic = blobmsg_open_array(&out, ".invalid");
+
+			for (j = 0; j < types[i].noptions; j++)
+				if (types[i].options[j].invalid)
+					blobmsg_add_string(&out, NULL, types[i].options[j].name);
+
+			blobmsg_close_array(&out, ic);
+			blobmsg_close_table(&out, sc);
+		}
+
+		blobmsg_close_table(&out, c);
+		uci_unload(ctx, p);
+		batch_free(types);
+	}
+
+	json = blobmsg_format_json(out.head, true);
+
+	if (json)
+		printf("%s\n", json);
+
+	free(json);
+	uci_free_context(ctx);
+
+	return rc;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -202,7 +517,9 @@ main(int argc, char **argv)
 	enum dt_type rv;
 	int i, rc;
 
-	if (argc == 3) {
+	if (argc == 3 && !strcmp(argv[1], "-s")) {
+		return validate_batch(argv[2]);
+	} else if (argc == 3) {
 		rv = dt_parse(argv[1], argv[2]);
 		fprintf(stderr, "%s - %s = %s\n", argv[1], argv[2], rv ? "true" : "false");
 		return rv ? 0 : 1;
@@ -8,6 +8,20 @@ enum dt_type {
 	DT_STRING
 };
 
+struct dt_code;
+
+/*
+ * dt_compile() parses a datatype expression once so that dt_check() can
+ * validate any number of values against it, dt_parse() does both for a
+ * single value. A compiled expression caches its regexes and the values
+ * uci() refers to, so it must not be checked from two threads at once.
+ * The uci() values are looked up again when their package changed on
+ * disk, which is checked at most once a second.
+ */
+struct dt_code *dt_compile(const char *code);
+enum dt_type dt_check(struct dt_code *code, const char *value);
+void dt_free(struct dt_code *code);
+
 enum dt_type dt_parse(const char *code, const char *value);
 
 #endif
@@ -15,19 +15,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <ctype.h>
 
-#include <arpa/inet.h>
-#include <netinet/ether.h>
 #include <sys/stat.h>
 
 #include <sys/types.h>
 #include <regex.h>
+#include <time.h>
 
 #include <uci.h>
 
 #include "libvalidate.h"
 
+#define DT_MAX_OPS	32
+#define DT_UCI_RECHECK	1	/* seconds between stat() of a uci() package */
+
 enum dt_optype {
 	OP_UNKNOWN,
 	OP_NUMBER,
@@ -56,7 +59,36 @@ struct dt_state {
 	struct uci_context *ctx;
 	const char *value;
 	enum dt_type valtype;
-	struct dt_op stack[32];
+	struct dt_op *stack;
+	struct dt_code *code;
+};
+
+struct dt_set {
+	char **slots;
+	unsigned int size;
+	unsigned int count;
+};
+
+struct dt_stamp {
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+};
+
+/* per function op state kept across dt_check() calls */
+struct dt_cache {
+	bool valid;
+	bool regex;
+	regex_t re;
+	struct dt_set set;
+	struct dt_stamp stamp[2];	/* package file and its saved delta */
+	time_t checked;			/* when stamp was last compared */
+};
+
+struct dt_code {
+	struct dt_op ops[DT_MAX_OPS];
+	struct dt_cache *cache[DT_MAX_OPS];
+	char source[];
 };
 
 struct dt_fun {
@@ -108,6 +140,100 @@ dt_test_string(const char *s, const char *end, const char *value)
 	return (*s == *value || (s >= end && *value == 0));
 }
 
+static unsigned int
+dt_set_hash(const char *str)
+{
+	unsigned int h = 2166136261u;
+
+	while (*str)
+	{
+		h ^= (unsigned char)*str++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static char **
+dt_set_slot(struct dt_set *set, const char *str)
+{
+	unsigned int i = dt_set_hash(str) & (set->size - 1);
+
+	while (set->slots[i] && strcmp(set->slots[i], str))
+		i = (i + 1) & (set->size - 1);
+
+	return &set->slots[i];
+}
+
+static bool
+dt_set_add(struct dt_set *set, const char *str)
+{
+	char **slot, **old = set->slots;
+	unsigned int i, size = set->size;
+
+	if ((set->count + 1) * 4 > size * 3)
+	{
+		set->size = size ? size * 2 : 16;
+		set->slots = calloc(set->size, sizeof(*set->slots));
+
+		if (!set->slots)
+		{
+			set->slots = old;
+			set->size = size;
+			return false;
+		}
+
+		for (i = 0; i < size; i++)
+			if (old[i])
+				*dt_set_slot(set, old[i]) = old[i];
+
+		free(old);
+	}
+
+	slot = dt_set_slot(set, str);
+
+	if (*slot)
+		return true;
+
+	*slot = strdup(str);
+
+	if (!*slot)
+		return false;
+
+	set->count++;
+	return true;
+}
+
+static bool
+dt_set_has(struct dt_set *set, const char *str)
+{
+	return set->size && *dt_set_slot(set, str);
+}
+
+static void
+dt_set_free(struct dt_set *set)
+{
+	unsigned int i;
+
+	for (i = 0; i < set->size; i++)
+		free(set->slots[i]);
+
+	free(set->slots);
+	memset(set, 0, sizeof(*set));
+}
+
+static struct dt_cache *
+dt_get_cache(struct dt_state *s)
+{
+	/* the function op is the one right before its arguments */
+	struct dt_cache **c = &s->code->cache[s->pos - 1];
+
+	if (!*c)
+		*c = calloc(1, sizeof(**c));
+
+	return *c;
+}
+
 static bool
 dt_step(struct dt_state *s);
 
@@ -324,7 +450,7 @@ dt_type_float(struct dt_state *s, int nargs)
 static bool
 dt_type_ufloat(struct dt_state *s, int nargs)
 {
-	int n;
+	double n;
 	char *e;
 
 	n = strtod(s->value, &e);
@@ -388,121 +514,285 @@ dt_type_hexstring(struct dt_state *s, int nargs)
 	return true;
 }
 
-static bool
-dt_type_ip4addr(struct dt_state *s, int nargs)
+/*
+ * Address scanners: each one parses an address at p without copying it
+ * and returns a pointer to the first character after it, or NULL if p
+ * does not start with a valid address. The callers check what follows.
+ */
+static int
+dt_hexval(char c)
 {
-	struct in6_addr a;
-	return inet_pton(AF_INET, s->value, &a);
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	else if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
 }
 
-static bool
-dt_type_ip6addr(struct dt_state *s, int nargs)
+static const char *
+dt_scan_uint(const char *p, unsigned int max)
 {
-	struct in6_addr a;
-	return inet_pton(AF_INET6, s->value, &a);
+	const char *start = p;
+	unsigned int n = 0;
+
+	while (*p >= '0' && *p <= '9')
+	{
+		n = n * 10 + (*p++ - '0');
+
+		if (n > max)
+			return NULL;
+	}
+
+	return (p > start) ? p : NULL;
 }
 
-static bool
-dt_type_ipaddr(struct dt_state *s, int nargs)
+/* dotted quad as accepted by inet_pton(), without leading zeros */
+static const char *
+dt_scan_ip4(const char *p, uint32_t *addr)
 {
-	return (dt_type_ip4addr(s, 0) || dt_type_ip6addr(s, 0));
+	unsigned int v = 0, digits = 0, octets = 0;
+	uint32_t a = 0;
+
+	for (;; p++)
+	{
+		if (*p >= '0' && *p <= '9')
+		{
+			if (digits && !v)
+				return NULL;
+
+			v = v * 10 + (*p - '0');
+
+			if (++digits > 3 || v > 255)
+				return NULL;
+
+			continue;
+		}
+
+		if (!digits)
+			return NULL;
+
+		a = (a << 8) | v;
+
+		if (++octets == 4)
+			break;
+
+		if (*p != '.')
+			return NULL;
+
+		v = digits = 0;
+	}
+
+	if (addr)
+		*addr = a;
+
+	return p;
 }
 
-static bool
-dt_type_netmask4(struct dt_state *s, int nargs)
+/* RFC 4291 text form, optionally ending in a dotted quad */
+static const char *
+dt_scan_ip6(const char *p, uint8_t *addr)
+{
+	uint8_t buf[16];
+	const char *group;
+	unsigned int v = 0;
+	int i = 0, gap = -1, digits = 0, h;
+	uint32_t a4;
+
+	if (*p == ':' && *++p != ':')
+		return NULL;
+
+	for (group = p;; p++)
+	{
+		h = dt_hexval(*p);
+
+		if (h >= 0)
+		{
+			if (++digits > 4)
+				return NULL;
+
+			v = (v << 4) | h;
+			continue;
+		}
+
+		if (*p == ':')
+		{
+			if (!digits)
+			{
+				if (gap >= 0)
+					return NULL;
+
+				gap = i;
+			}
+			else
+			{
+				if (i > 14 || (dt_hexval(p[1]) < 0 && p[1] != ':'))
+					return NULL;
+
+				buf[i++] = v >> 8;
+				buf[i++] = v;
+				v = digits = 0;
+			}
+
+			group = p + 1;
+			continue;
+		}
+
+		if (*p == '.')
+		{
+			if (i > 12 || !(p = dt_scan_ip4(group, &a4)))
+				return NULL;
+
+			buf[i++] = a4 >> 24;
+			buf[i++] = a4 >> 16;
+			buf[i++] = a4 >> 8;
+			buf[i++] = a4;
+			digits = 0;
+		}
+
+		break;
+	}
+
+	if (digits)
+	{
+		if (i > 14)
+			return NULL;
+
+		buf[i++] = v >> 8;
+		buf[i++] = v;
+	}
+
+	if (gap >= 0)
+	{
+		/* "::" must stand for at least one group */
+		if (i == 16)
+			return NULL;
+
+		memmove(buf + 16 - (i - gap), buf + gap, i - gap);
+		memset(buf + gap, 0, 16 - i);
+	}
+	else if (i != 16)
+	{
+		return NULL;
+	}
+
+	if (addr)
+		memcpy(addr, buf, 16);
+
+	return p;
+}
+
+/* six groups of one or two hex digits separated by colons */
+static const char *
+dt_scan_mac(const char *p)
 {
 	int i;
-	struct in_addr a;
 
-	if (!inet_pton(AF_INET, s->value, &a))
-		return false;
+	for (i = 0; i < 6; i++)
+	{
+		if (i && *p++ != ':')
+			return NULL;
 
-	if (a.s_addr == 0)
-		return true;
+		if (dt_hexval(*p++) < 0)
+			return NULL;
 
-	a.s_addr = ntohl(a.s_addr);
+		if (dt_hexval(*p) >= 0)
+			p++;
+	}
+
+	return p;
+}
 
-	for (i = 0; (i < 32) && !(a.s_addr & (1 << i)); i++);
+static bool
+dt_is_netmask4(uint32_t mask)
+{
+	mask = ~mask;
 
-	return ((uint32_t)(~((1 << i) - 1)) == a.s_addr);
+	return !(mask & (mask + 1));
 }
 
 static bool
-dt_type_netmask6(struct dt_state *s, int nargs)
+dt_is_netmask6(const uint8_t *a)
 {
 	int i;
-	struct in6_addr a;
-
-	if (!inet_pton(AF_INET6, s->value, &a))
-		return false;
 
-	for (i = 0; (i < 16) && (a.s6_addr[i] == 0xFF); i++);
+	for (i = 0; (i < 16) && (a[i] == 0xFF); i++);
 
 	if (i == 16)
 		return true;
 
-	if ((a.s6_addr[i] != 255) && (a.s6_addr[i] != 254) &&
-		(a.s6_addr[i] != 252) && (a.s6_addr[i] != 248) &&
-		(a.s6_addr[i] != 240) && (a.s6_addr[i] != 224) &&
-		(a.s6_addr[i] != 192) && (a.s6_addr[i] != 128) &&
-		(a.s6_addr[i] != 0))
+	if ((a[i] != 255) && (a[i] != 254) &&
+		(a[i] != 252) && (a[i] != 248) &&
+		(a[i] != 240) && (a[i] != 224) &&
+		(a[i] != 192) && (a[i] != 128) &&
+		(a[i] != 0))
 		return false;
 
-	for (; (i < 16) && (a.s6_addr[i] == 0); i++);
+	for (i++; (i < 16) && (a[i] == 0); i++);
 
 	return (i == 16);
 }
 
 static bool
-dt_type_cidr4(struct dt_state *s, int nargs)
+dt_type_ip4addr(struct dt_state *s, int nargs)
 {
-	int n;
-	struct in_addr a;
-	char *p, buf[sizeof("255.255.255.255/32\0")];
+	const char *p = dt_scan_ip4(s->value, NULL);
+	return (p && !*p);
+}
 
-	if (strlen(s->value) >= sizeof(buf))
-		return false;
+static bool
+dt_type_ip6addr(struct dt_state *s, int nargs)
+{
+	const char *p = dt_scan_ip6(s->value, NULL);
+	return (p && !*p);
+}
 
-	strcpy(buf, s->value);
-	p = strchr(buf, '/');
+static bool
+dt_type_ipaddr(struct dt_state *s, int nargs)
+{
+	return (dt_type_ip4addr(s, 0) || dt_type_ip6addr(s, 0));
+}
 
-	if (p)
-	{
-		*p++ = 0;
+static bool
+dt_type_netmask4(struct dt_state *s, int nargs)
+{
+	uint32_t a;
+	const char *p = dt_scan_ip4(s->value, &a);
 
-		n = strtoul(p, &p, 10);
+	return (p && !*p && dt_is_netmask4(a));
+}
 
-		if ((*p != 0) || (n > 32))
-			return false;
-	}
+static bool
+dt_type_netmask6(struct dt_state *s, int nargs)
+{
+	uint8_t a[16];
+	const char *p = dt_scan_ip6(s->value, a);
 
-	return inet_pton(AF_INET, buf, &a);
+	return (p && !*p && dt_is_netmask6(a));
 }
 
 static bool
-dt_type_cidr6(struct dt_state *s, int nargs)
+dt_type_cidr4(struct dt_state *s, int nargs)
 {
-	int n;
-	struct in6_addr a;
-	char *p, buf[sizeof("FFFF:FFFF:FFFF:FFFF:FFFF:FFFF:255.255.255.255/128\0")];
-
-	if (strlen(s->value) >= sizeof(buf))
-		return false;
+	const char *p = dt_scan_ip4(s->value, NULL);
 
-	strcpy(buf, s->value);
-	p = strchr(buf, '/');
+	if (p && *p == '/')
+		p = dt_scan_uint(p + 1, 32);
 
-	if (p)
-	{
-		*p++ = 0;
+	return (p && !*p);
+}
 
-		n = strtoul(p, &p, 10);
+static bool
+dt_type_cidr6(struct dt_state *s, int nargs)
+{
+	const char *p = dt_scan_ip6(s->value, NULL);
 
-		if ((*p != 0) || (n > 128))
-			return false;
-	}
+	if (p && *p == '/')
+		p = dt_scan_uint(p + 1, 128);
 
-	return inet_pton(AF_INET6, buf, &a);
+	return (p && !*p);
 }
 
 static bool
@@ -514,62 +804,35 @@ dt_type_cidr(struct dt_state *s, int nargs)
 static bool
 dt_type_ipmask4(struct dt_state *s, int nargs)
 {
-	bool rv;
-	struct in_addr a;
-	const char *value;
-	char *p, buf[sizeof("255.255.255.255/255.255.255.255\0")];
-
-	if (strlen(s->value) >= sizeof(buf))
-		return false;
+	uint32_t mask;
+	const char *p = dt_scan_ip4(s->value, NULL);
 
-	strcpy(buf, s->value);
-	p = strchr(buf, '/');
-
-	if (p)
+	if (p && *p == '/')
 	{
-		*p++ = 0;
-
-		value = s->value;
-		s->value = p;
-		rv = dt_type_netmask4(s, 0);
-		s->value = value;
+		p = dt_scan_ip4(p + 1, &mask);
 
-		if (!rv)
+		if (p && !dt_is_netmask4(mask))
 			return false;
 	}
 
-	return inet_pton(AF_INET, buf, &a);
+	return (p && !*p);
 }
 
 static bool
 dt_type_ipmask6(struct dt_state *s, int nargs)
 {
-	bool rv;
-	struct in6_addr a;
-	const char *value;
-	char *p, buf[sizeof("FFFF:FFFF:FFFF:FFFF:FFFF:FFFF:255.255.255.255/"
-	                    "FFFF:FFFF:FFFF:FFFF:FFFF:FFFF:255.255.255.255\0")];
+	uint8_t mask[16];
+	const char *p = dt_scan_ip6(s->value, NULL);
 
-	if (strlen(s->value) >= sizeof(buf))
-		return false;
-
-	strcpy(buf, s->value);
-	p = strchr(buf, '/');
-
-	if (p)
+	if (p && *p == '/')
 	{
-		*p++ = 0;
+		p = dt_scan_ip6(p + 1, mask);
 
-		value = s->value;
-		s->value = p;
-		rv = dt_type_netmask6(s, 0);
-		s->value = value;
-
-		if (!rv)
+		if (p && !dt_is_netmask6(mask))
 			return false;
 	}
 
-	return inet_pton(AF_INET6, buf, &a);
+	return (p && !*p);
 }
 
 static bool
@@ -608,7 +871,8 @@ dt_type_portrange(struct dt_state *s, int nargs)
 static bool
 dt_type_macaddr(struct dt_state *s, int nargs)
 {
-	return !!ether_aton(s->value);
+	const char *p = dt_scan_mac(s->value);
+	return (p && !*p);
 }
 
 static bool
@@ -742,34 +1006,37 @@ dt_type_file(struct dt_state *s, int nargs)
 static bool
 dt_type_regex(struct dt_state *s, int nargs)
 {
-	bool rv;
 	int relen;
-	regex_t pattern;
 	char *re = NULL;
+	struct dt_cache *c;
 
 	if (nargs < 1 || s->stack[s->pos].type != OP_STRING)
 		return false;
 
-	relen = s->stack[s->pos].length;
-	re = alloca(relen + 3);
+	c = dt_get_cache(s);
 
-	if (!re)
+	if (!c)
 		return false;
 
-	memset(re, 0, relen + 3);
-	memcpy(re + 1, s->stack[s->pos].value.string, relen);
+	if (!c->valid)
+	{
+		relen = s->stack[s->pos].length;
+		re = alloca(relen + 3);
 
-	re[0] = '^';
-	re[relen + 1] = '$';
+		if (!re)
+			return false;
 
-	if (regcomp(&pattern, re, REG_EXTENDED | REG_NOSUB))
-		return false;
+		memset(re, 0, relen + 3);
+		memcpy(re + 1, s->stack[s->pos].value.string, relen);
 
-	rv = !regexec(&pattern, s->value, 0, NULL, 0);
+		re[0] = '^';
+		re[relen + 1] = '$';
 
-	regfree(&pattern);
+		c->valid = true;
+		c->regex = !regcomp(&c->re, re, REG_EXTENDED | REG_NOSUB);
+	}
 
-	return rv;
+	return c->regex && !regexec(&c->re, s->value, 0, NULL, 0);
 }
 
 static void *
@@ -806,43 +1073,104 @@ dt_uci_lookup(struct dt_state *s, const char *pkg,
 }
 
 static bool
-dt_uci_cmp(struct dt_state *s,
-           const char *pkg, const char *sct, const char *opt)
+dt_uci_collect(struct dt_state *s, struct dt_set *set,
+               const char *pkg, const char *sct, const char *opt)
 {
 	struct uci_element *e;
 	struct uci_option *o = dt_uci_lookup(s, pkg, sct, opt, UCI_TYPE_OPTION);
 
 	if (!o)
-		return false;
+		return true;
 
 	switch (o->type)
 	{
 	case UCI_TYPE_STRING:
-		if (!strcmp(s->value, o->v.string))
-			return true;
-		break;
+		return dt_set_add(set, o->v.string);
 
 	case UCI_TYPE_LIST:
 		uci_foreach_element(&o->v.list, e)
-			if (!strcmp(s->value, e->name))
-				return true;
+			if (!dt_set_add(set, e->name))
+				return false;
 		break;
 	}
 
-	return false;
+	return true;
 }
 
+/* collect every value the uci() arguments in cso may refer to */
 static bool
-dt_type_uci(struct dt_state *s, int nargs)
+dt_uci_snapshot(struct dt_state *s, struct dt_set *set, char **cso)
 {
-	int i, len;
 	struct uci_element *e;
 	struct uci_package *p;
-	char *cso[3] = { };
+
+	/* only expressions using uci() need a context */
+	if (!s->ctx)
+		s->ctx = uci_alloc_context();
 
 	if (!s->ctx)
 		return false;
 
+	if (*cso[1] != '@')
+		return dt_uci_collect(s, set, cso[0], cso[1], cso[2]);
+
+	p = dt_uci_lookup(s, cso[0], NULL, NULL, UCI_TYPE_PACKAGE);
+
+	if (!p)
+		return true;
+
+	uci_foreach_element(&p->sections, e)
+	{
+		if (strcmp(uci_to_section(e)->type, cso[1] + 1))
+			continue;
+
+		if (!cso[2])
+		{
+			if (!dt_set_add(set, e->name))
+				return false;
+		}
+		else
+		{
+			if (!dt_uci_collect(s, set, cso[0], e->name, cso[2]))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static void
+dt_uci_stamp(const char *pkg, struct dt_stamp *stamp)
+{
+	const char *dirs[2] = { UCI_CONFDIR, UCI_SAVEDIR };
+	char path[256];
+	struct stat st;
+	int i;
+
+	memset(stamp, 0, 2 * sizeof(*stamp));
+
+	for (i = 0; i < 2; i++)
+	{
+		snprintf(path, sizeof(path), "%s/%s", dirs[i], pkg);
+
+		if (stat(path, &st))
+			continue;
+
+		stamp[i].ino = st.st_ino;
+		stamp[i].size = st.st_size;
+		stamp[i].mtime = st.st_mtim;
+	}
+}
+
+static bool
+dt_type_uci(struct dt_state *s, int nargs)
+{
+	int i, len;
+	char *cso[3] = { };
+	struct dt_stamp stamp[2];
+	struct timespec now;
+	struct dt_cache *c;
+
 	for (i = 0; i < nargs && i < 3; i++)
 	{
 		if (s->stack[s->pos + i].type != OP_STRING)
@@ -861,32 +1189,32 @@ dt_type_uci(struct dt_state *s, int nargs)
 	if (!cso[0] || !cso[1] || (*cso[1] != '@' && !cso[2]))
 		return false;
 
-	if (*cso[1] != '@')
-		return dt_uci_cmp(s, cso[0], cso[1], cso[2]);
+	c = dt_get_cache(s);
 
-	p = dt_uci_lookup(s, cso[0], NULL, NULL, UCI_TYPE_PACKAGE);
-
-	if (!p)
+	if (!c)
 		return false;
 
-	uci_foreach_element(&p->sections, e)
+	/*
+	 * rebuild the value set when the package changed on disk, but only
+	 * look at the files every DT_UCI_RECHECK seconds to keep the stat()
+	 * calls out of the per value path
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (!c->valid || (now.tv_sec - c->checked >= DT_UCI_RECHECK))
 	{
-		if (strcmp(uci_to_section(e)->type, cso[1] + 1))
-			continue;
+		c->checked = now.tv_sec;
+		dt_uci_stamp(cso[0], stamp);
 
-		if (!cso[2])
-		{
-			if (!strcmp(s->value, e->name))
-				return true;
-		}
-		else
+		if (!c->valid || memcmp(stamp, c->stamp, sizeof(stamp)))
 		{
-			if (dt_uci_cmp(s, cso[0], e->name, cso[2]))
-				return true;
+			dt_set_free(&c->set);
+			memcpy(c->stamp, stamp, sizeof(stamp));
+			c->valid = dt_uci_snapshot(s, &c->set, cso);
 		}
 	}
 
-	return false;
+	return c->valid && dt_set_has(&c->set, s->value);
 }
 
 
@@ -965,7 +1293,7 @@ dt_parse_atom(struct dt_state *s, const char *label, const char *end)
 	struct dt_fun *func;
 	struct dt_op *op = &s->stack[s->depth];
 
-	if ((s->depth + 1) >= (sizeof(s->stack) / sizeof(s->stack[0])))
+	if ((s->depth + 1) >= DT_MAX_OPS)
 	{
 		printf("Syntax error, expression too long\n");
 		return false;
@@ -1069,6 +1397,12 @@ dt_parse_expr(const char *code, const char *end, struct dt_state *s)
 			while (isspace(*end) && end > tok->next + 1)
 				end--;
 
+			if (end == tok->next || *end != ')')
+			{
+				printf("Syntax error, expected ')' after function arguments\n");
+				return false;
+			}
+
 			return dt_parse_list(s, tok->next + 1, end);
 		}
 		else if (tok->next == end)
@@ -1091,7 +1425,7 @@ dt_parse_expr(const char *code, const char *end, struct dt_state *s)
 static bool
 dt_parse_list(struct dt_state *s, const char *code, const char *end)
 {
-	char c;
+	char c, q;
 	bool esc;
 	int nest;
 	const char *p, *last;
@@ -1102,7 +1436,7 @@ dt_parse_list(struct dt_state *s, const char *code, const char *end)
 
 	fptr = &s->stack[s->depth - 1];
 
-	for (nest = 0, p = last = code, esc = false, c = *p;
+	for (nest = 0, p = last = code, esc = false, q = 0, c = (p < end) ? *p : '\0';
 	     p <= end;
 	     p++, c = (p < end) ? *p : '\0')
 	{
@@ -1112,18 +1446,38 @@ dt_parse_list(struct dt_state *s, const char *code, const char *end)
 			continue;
 		}
 
+		/* parentheses and commas within strings are literals */
+		if (q && c != '\0')
+		{
+			if (c == '\\')
+				esc = true;
+			else if (c == q)
+				q = 0;
+
+			continue;
+		}
+
 		switch (c)
 		{
 		case '\\':
 			esc = true;
 			break;
 
+		case '"':
+		case '\'':
+			q = c;
+			break;
+
 		case '(':
 			nest++;
 			break;
 
 		case ')':
-			nest--;
+			if (--nest < 0)
+			{
+				printf("Syntax error, unbalanced ')'\n");
+				return false;
+			}
 			break;
 
 		case ',':
@@ -1145,6 +1499,12 @@ dt_parse_list(struct dt_state *s, const char *code, const char *end)
 		}
 	}
 
+	if (nest > 0)
+	{
+		printf("Syntax error, unbalanced '('\n");
+		return false;
+	}
+
 	fptr->nextop = s->depth;
 	return true;
 }
@@ -1201,30 +1561,43 @@ dt_call(struct dt_state *s)
 	return rv;
 }
 
-enum dt_type
-dt_parse(const char *code, const char *value)
+struct dt_code *
+dt_compile(const char *code)
 {
-	enum dt_type rv = DT_INVALID;
+	struct dt_code *c;
+	struct dt_state s = { .depth = 1 };
+	size_t len = strlen(code);
 
-	struct dt_state s = {
-		.depth = 1,
-		.stack = {
-			{
-				.type = OP_FUNCTION,
-				.value.function = &dt_types[0],
-				.next = code
-			}
-		}
-	};
+	c = calloc(1, sizeof(*c) + len + 1);
 
-	if (!value || !*value)
-		return false;
+	if (!c)
+		return NULL;
 
-	if (!dt_parse_list(&s, code, code + strlen(code)))
-		return false;
+	/* the ops point into the copy of the expression */
+	memcpy(c->source, code, len + 1);
+
+	c->ops[0].type = OP_FUNCTION;
+	c->ops[0].value.function = &dt_types[0];
+	c->ops[0].next = c->source;
+	s.stack = c->ops;
 
-	s.ctx = uci_alloc_context();
-	s.value = value;
+	if (!dt_parse_list(&s, c->source, c->source + len))
+	{
+		free(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+enum dt_type
+dt_check(struct dt_code *code, const char *value)
+{
+	enum dt_type rv = DT_INVALID;
+	struct dt_state s = { .stack = code->ops, .code = code, .value = value };
+
+	if (!value || !*value)
+		return DT_INVALID;
 
 	if (dt_call(&s))
 		rv = s.valtype;
@@ -1234,3 +1607,43 @@ dt_parse(const char *code, const char *value)
 
 	return rv;
 }
+
+void
+dt_free(struct dt_code *code)
+{
+	int i;
+
+	for (i = 0; i < DT_MAX_OPS; i++)
+	{
+		if (!code->cache[i])
+			continue;
+
+		if (code->cache[i]->regex)
+			regfree(&code->cache[i]->re);
+
+		dt_set_free(&code->cache[i]->set);
+		free(code->cache[i]);
+	}
+
+	free(code);
+}
+
+enum dt_type
+dt_parse(const char *code, const char *value)
+{
+	enum dt_type rv;
+	struct dt_code *c;
+
+	if (!value || !*value)
+		return DT_INVALID;
+
+	c = dt_compile(code);
+
+	if (!c)
+		return DT_INVALID;
+
+	rv = dt_check(c, value);
+	dt_free(c);
+
+	return rv;
+}